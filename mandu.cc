@@ -5,7 +5,36 @@
 #include <cstdarg>
 #include <cstdlib>
 #include <cstdio>
+#include <climits>
+#include <stdint.h>
 #include <algorithm>
+#include <utility>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <thread>
+#include <deque>
+#include <condition_variable>
+#include <unordered_map>
+#include <list>
+#include <memory>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <ucontext.h>
+
+#ifdef MANDU_USE_ZLIB
+#include <zlib.h>
+#endif // MANDU_USE_ZLIB
+
+#if defined(__SSE2__) && defined(__GNUC__)
+#include <emmintrin.h>
+#define MANDU_SSE2
+#endif // __SSE2__
 
 #define UNREACHABLE(x) \
    do { \
@@ -22,19 +51,262 @@ namespace {
 using mandu::Mandu;
 using mandu::SoupMaker;
 
-char* string_to_array( std::string* str , int pos ) {
-    return &(*str->begin()) + pos;
+// Source is a read only view of the template text. The text may live inside of
+// a std::string or inside of a read only file mapping , so the executor never
+// needs to copy it. Positions are std::size_t which allows template larger
+// than 2GB on 64 bits platform.
+class Source {
+public:
+    Source():
+        data_(NULL),
+        size_(0)
+    {}
+
+    Source( const char* data , std::size_t size ):
+        data_(data),
+        size_(size)
+    {}
+
+    explicit Source( const std::string& str ):
+        data_(str.data()),
+        size_(str.size())
+    {}
+
+    char at( std::size_t pos ) const {
+        assert( pos < size_ );
+        return data_[pos];
+    }
+
+    const char* data() const {
+        return data_;
+    }
+
+    std::size_t size() const {
+        return size_;
+    }
+
+private:
+    const char* data_;
+    std::size_t size_;
+};
+
+// Tell a template apart by its size and its head. It is cheap and stays the
+// same when the same text is cooked from a new buffer each time.
+uint64_t TemplateKey( const Source& text ) {
+    uint64_t key = text.size();
+    for( std::size_t i = 0 ; i < text.size() && i < 64 ; ++i ) {
+        key = key * 31 + static_cast<unsigned char>(text.at(i));
+    }
+    return key;
+}
+
+// FNV-1a , used to fingerprint the segments and the values they read
+class Fingerprint {
+public:
+    Fingerprint():
+        hash_( 14695981039346656037ULL )
+    {}
+
+    void Mix( const char* data , std::size_t length ) {
+        for( std::size_t i = 0 ; i < length ; ++i ) {
+            hash_ ^= static_cast<unsigned char>(data[i]);
+            hash_ *= 1099511628211ULL;
+        }
+    }
+
+    void Mix( uint64_t value ) {
+        Mix( reinterpret_cast<const char*>(&value) , sizeof(value) );
+    }
+
+    uint64_t hash() const {
+        return hash_;
+    }
+
+private:
+    uint64_t hash_;
+};
+
+// FragmentKey collects the exact bytes a cached fragment depends on. The hash
+// only finds the entry , the bytes are compared before the entry is used , so
+// a collision never serves the output of other values. A key longer than
+// limit could never be stored , it stops growing then.
+class FragmentKey {
+public:
+    explicit FragmentKey( std::size_t limit ):
+        bytes_(),
+        limit_(limit),
+        overflow_(false)
+    {}
+
+    void Mix( const char* data , std::size_t length ) {
+        if( overflow_ || bytes_.size() + length > limit_ ) {
+            overflow_ = true;
+            return;
+        }
+        bytes_.append( data , length );
+    }
+
+    void Mix( uint64_t value ) {
+        Mix( reinterpret_cast<const char*>(&value) , sizeof(value) );
+    }
+
+    const std::string& bytes() const {
+        return bytes_;
+    }
+
+    bool overflow() const {
+        return overflow_;
+    }
+
+    uint64_t hash() const {
+        Fingerprint fingerprint;
+        fingerprint.Mix( bytes_.data() , bytes_.size() );
+        return fingerprint.hash();
+    }
+
+private:
+    std::string bytes_;
+    std::size_t limit_;
+    bool overflow_;
+};
+
+// Output is where the executor writes the cooked text to. Literal text is the
+// text that sits unchanged inside of the template source during the cook, an
+// output may keep a pointer to it instead of copying it.
+class Output {
+public:
+    virtual ~Output() {}
+
+    virtual void Append( const char* str , std::size_t length ) = 0;
+
+    virtual void AppendLiteral( const char* str , std::size_t length ) {
+        Append(str,length);
+    }
+
+    void AppendString( const std::string& str ) {
+        Append(str.data(),str.size());
+    }
+};
+
+class StringOutput : public Output {
+public:
+    explicit StringOutput( std::string* output ):
+        output_(output)
+    {}
+
+    virtual void Append( const char* str , std::size_t length ) {
+        output_->append(str,length);
+    }
+
+private:
+    std::string* output_;
+};
+
+class ScatterSink : public Output {
+public:
+    // With copy_literals the literal text is copied like the values , for a
+    // text which doesn't outlive the output
+    explicit ScatterSink( mandu::ScatterOutput* output , bool copy_literals = false ):
+        output_(output),
+        copy_literals_(copy_literals)
+    {}
+
+    virtual void Append( const char* str , std::size_t length ) {
+        output_->Append(str,length);
+    }
+
+    virtual void AppendLiteral( const char* str , std::size_t length ) {
+        if( copy_literals_ )
+            output_->Append(str,length);
+        else
+            output_->AppendLiteral(str,length);
+    }
+
+private:
+    mandu::ScatterOutput* output_;
+    bool copy_literals_;
+};
+
+#ifdef MANDU_USE_ZLIB
+class GzipSink : public Output {
+public:
+    explicit GzipSink( mandu::GzipOutput* output ):
+        output_(output)
+    {}
+
+    virtual void Append( const char* str , std::size_t length ) {
+        output_->Append(str,length);
+    }
+
+    virtual void AppendLiteral( const char* str , std::size_t length ) {
+        output_->AppendLiteral(str,length);
+    }
+
+private:
+    mandu::GzipOutput* output_;
+};
+
+// Feed the input to a raw deflate stream , the compressed bytes are appended
+// to the output. The input is split since zlib counts bytes with uInt.
+void RunDeflate( z_stream* stream , const char* str , std::size_t length ,
+        int flush , std::string* output ) {
+    static const std::size_t kMaxInput = 1<<30;
+    static const std::size_t kMinChunk = 1024;
+
+    do {
+        std::size_t piece = length > kMaxInput ? kMaxInput : length;
+        stream->next_in = reinterpret_cast<Bytef*>( const_cast<char*>(str) );
+        stream->avail_in = static_cast<uInt>(piece);
+        str += piece;
+        length -= piece;
+
+        int mode = length == 0 ? flush : Z_NO_FLUSH;
+        // The stream may hold pending output much larger than the input , so
+        // the chunk grows each round
+        std::size_t chunk = deflateBound( stream , static_cast<uLong>(piece) );
+        if( chunk < kMinChunk )
+            chunk = kMinChunk;
+        do {
+            std::size_t used = output->size();
+            output->resize( used + chunk );
+            stream->next_out = reinterpret_cast<Bytef*>( &(*output)[used] );
+            stream->avail_out = static_cast<uInt>(chunk);
+            int ret = deflate( stream , mode );
+            assert( ret != Z_STREAM_ERROR );
+            UNUSED_VARIABLE(ret);
+            output->resize( used + chunk - stream->avail_out );
+            chunk *= 2;
+        } while( stream->avail_out == 0 );
+    } while( length > 0 );
 }
 
-const char* string_to_array( const std::string* str , int pos ) {
-    return &(*str->begin()) + pos;
+z_stream* NewDeflateStream( int level ) {
+    z_stream* stream = new z_stream();
+    stream->zalloc = Z_NULL;
+    stream->zfree = Z_NULL;
+    stream->opaque = Z_NULL;
+    // Negative window bits gives raw deflate , the gzip framing is ours
+    if( deflateInit2( stream , level , Z_DEFLATED , -MAX_WBITS , 8 ,
+                Z_DEFAULT_STRATEGY ) != Z_OK ) {
+        delete stream;
+        return NULL;
+    }
+    return stream;
+}
+
+void DeleteDeflateStream( z_stream* stream ) {
+    if( stream != NULL ) {
+        deflateEnd(stream);
+        delete stream;
+    }
 }
+#endif // MANDU_USE_ZLIB
 
 enum TokenId {
     TK_SECTION_START, TK_SECTION_END ,
     TK_LSQR,TK_RSQR,TK_LBRA,TK_RBRA,
     TK_NUMBER,TK_STRING,TK_VARIABLE,
-    TK_COMMA,TK_SUB,TK_DOLLAR,TK_UNKNOWN,
+    TK_COMMA,TK_SUB,TK_DOLLAR,TK_PIPE,TK_PARTIAL,TK_COLON,TK_UNKNOWN,
     TK_END, TK_EOF
 };
 
@@ -54,6 +326,273 @@ struct Lexme {
 };
 
 
+// Escaping filters. A filter could be attached to a substitution , eg $|html ,
+// or to a sentence , eg Var|json. The filter is an Output wrapper , so values
+// are escaped while they are written out and no escaped copy is made.
+enum FilterId {
+    FILTER_NONE,
+    FILTER_HTML,
+    FILTER_JSON,
+    FILTER_URL
+};
+
+int FindFilter( const char* name , std::size_t length ) {
+    static const struct {
+        const char* name;
+        int filter;
+    } kFilters[] = {
+        { "html" , FILTER_HTML },
+        { "json" , FILTER_JSON },
+        { "url"  , FILTER_URL  }
+    };
+    for( std::size_t i = 0 ; i < sizeof(kFilters)/sizeof(kFilters[0]) ; ++i ) {
+        if( strlen(kFilters[i].name) == length &&
+            memcmp(kFilters[i].name,name,length) == 0 )
+            return kFilters[i].filter;
+    }
+    return FILTER_NONE;
+}
+
+bool IsHtmlSpecialChar( unsigned char cha ) {
+    return cha == '&' || cha == '<' || cha == '>' || cha == '"' || cha == '\'';
+}
+
+bool IsJsonSpecialChar( unsigned char cha ) {
+    return cha == '"' || cha == '\\' || cha < 0x20;
+}
+
+bool IsUrlSpecialChar( unsigned char cha ) {
+    return !( std::isalnum(cha) || cha == '-' || cha == '_' || cha == '.' || cha == '~' );
+}
+
+// The scan kernels return the index of the first character that needs to be
+// escaped , or length if there is none. Runs without special characters are
+// skipped 16 bytes at a time with SSE2.
+std::size_t ScanHtml( const char* str , std::size_t length ) {
+    std::size_t i = 0;
+#ifdef MANDU_SSE2
+    const __m128i amp = _mm_set1_epi8('&');
+    const __m128i lt = _mm_set1_epi8('<');
+    const __m128i gt = _mm_set1_epi8('>');
+    const __m128i quot = _mm_set1_epi8('"');
+    const __m128i apos = _mm_set1_epi8('\'');
+    for( ; i + 16 <= length ; i += 16 ) {
+        __m128i v = _mm_loadu_si128( reinterpret_cast<const __m128i*>(str+i) );
+        __m128i m = _mm_or_si128(
+                _mm_or_si128( _mm_cmpeq_epi8(v,amp) , _mm_cmpeq_epi8(v,lt) ) ,
+                _mm_or_si128( _mm_or_si128( _mm_cmpeq_epi8(v,gt) , _mm_cmpeq_epi8(v,quot) ) ,
+                              _mm_cmpeq_epi8(v,apos) ) );
+        int mask = _mm_movemask_epi8(m);
+        if( mask != 0 )
+            return i + __builtin_ctz(mask);
+    }
+#endif // MANDU_SSE2
+    for( ; i < length ; ++i ) {
+        if( IsHtmlSpecialChar( static_cast<unsigned char>(str[i]) ) )
+            return i;
+    }
+    return length;
+}
+
+std::size_t ScanJson( const char* str , std::size_t length ) {
+    std::size_t i = 0;
+#ifdef MANDU_SSE2
+    const __m128i quot = _mm_set1_epi8('"');
+    const __m128i slash = _mm_set1_epi8('\\');
+    const __m128i control = _mm_set1_epi8(0x1f);
+    for( ; i + 16 <= length ; i += 16 ) {
+        __m128i v = _mm_loadu_si128( reinterpret_cast<const __m128i*>(str+i) );
+        // Unsigned v <= 0x1f is the same as min(v,0x1f) == v
+        __m128i m = _mm_or_si128(
+                _mm_or_si128( _mm_cmpeq_epi8(v,quot) , _mm_cmpeq_epi8(v,slash) ) ,
+                _mm_cmpeq_epi8( _mm_min_epu8(v,control) , v ) );
+        int mask = _mm_movemask_epi8(m);
+        if( mask != 0 )
+            return i + __builtin_ctz(mask);
+    }
+#endif // MANDU_SSE2
+    for( ; i < length ; ++i ) {
+        if( IsJsonSpecialChar( static_cast<unsigned char>(str[i]) ) )
+            return i;
+    }
+    return length;
+}
+
+std::size_t ScanUrl( const char* str , std::size_t length ) {
+    std::size_t i = 0;
+#ifdef MANDU_SSE2
+    // Signed compare is fine here , non ASCII bytes are negative and they
+    // fall out of all the ranges.
+    const __m128i lower_a = _mm_set1_epi8('a'-1);
+    const __m128i lower_z = _mm_set1_epi8('z'+1);
+    const __m128i upper_a = _mm_set1_epi8('A'-1);
+    const __m128i upper_z = _mm_set1_epi8('Z'+1);
+    const __m128i digit_0 = _mm_set1_epi8('0'-1);
+    const __m128i digit_9 = _mm_set1_epi8('9'+1);
+    const __m128i dash = _mm_set1_epi8('-');
+    const __m128i underscore = _mm_set1_epi8('_');
+    const __m128i dot = _mm_set1_epi8('.');
+    const __m128i tilde = _mm_set1_epi8('~');
+    for( ; i + 16 <= length ; i += 16 ) {
+        __m128i v = _mm_loadu_si128( reinterpret_cast<const __m128i*>(str+i) );
+        __m128i lower = _mm_and_si128( _mm_cmpgt_epi8(v,lower_a) , _mm_cmplt_epi8(v,lower_z) );
+        __m128i upper = _mm_and_si128( _mm_cmpgt_epi8(v,upper_a) , _mm_cmplt_epi8(v,upper_z) );
+        __m128i digit = _mm_and_si128( _mm_cmpgt_epi8(v,digit_0) , _mm_cmplt_epi8(v,digit_9) );
+        __m128i mark = _mm_or_si128(
+                _mm_or_si128( _mm_cmpeq_epi8(v,dash) , _mm_cmpeq_epi8(v,underscore) ) ,
+                _mm_or_si128( _mm_cmpeq_epi8(v,dot) , _mm_cmpeq_epi8(v,tilde) ) );
+        __m128i ok = _mm_or_si128( _mm_or_si128(lower,upper) , _mm_or_si128(digit,mark) );
+        int mask = ~_mm_movemask_epi8(ok) & 0xffff;
+        if( mask != 0 )
+            return i + __builtin_ctz(mask);
+    }
+#endif // MANDU_SSE2
+    for( ; i < length ; ++i ) {
+        if( IsUrlSpecialChar( static_cast<unsigned char>(str[i]) ) )
+            return i;
+    }
+    return length;
+}
+
+class FilterOutput : public Output {
+public:
+    FilterOutput( Output* output , int filter ):
+        output_(output),
+        filter_(filter)
+    {}
+
+    virtual void Append( const char* str , std::size_t length );
+
+private:
+    std::size_t Scan( const char* str , std::size_t length ) const {
+        switch( filter_ ) {
+            case FILTER_HTML: return ScanHtml(str,length);
+            case FILTER_JSON: return ScanJson(str,length);
+            case FILTER_URL:  return ScanUrl(str,length);
+            default: UNREACHABLE(return length);
+        }
+    }
+
+    void Escape( unsigned char cha );
+
+    Output* output_;
+    int filter_;
+};
+
+void FilterOutput::Append( const char* str , std::size_t length ) {
+    while( length > 0 ) {
+        std::size_t run = Scan(str,length);
+        // The run without special characters goes straight to the output
+        if( run > 0 )
+            output_->Append(str,run);
+        if( run == length )
+            return;
+        Escape( static_cast<unsigned char>(str[run]) );
+        str += run + 1;
+        length -= run + 1;
+    }
+}
+
+void FilterOutput::Escape( unsigned char cha ) {
+    static const char kHex[] = "0123456789ABCDEF";
+    char buf[8];
+
+    switch( filter_ ) {
+        case FILTER_HTML:
+            switch( cha ) {
+                case '&': output_->Append("&amp;",5); return;
+                case '<': output_->Append("&lt;",4); return;
+                case '>': output_->Append("&gt;",4); return;
+                case '"': output_->Append("&quot;",6); return;
+                default:  output_->Append("&#39;",5); return;
+            }
+        case FILTER_JSON:
+            switch( cha ) {
+                case '"':  output_->Append("\\\"",2); return;
+                case '\\': output_->Append("\\\\",2); return;
+                case '\n': output_->Append("\\n",2); return;
+                case '\r': output_->Append("\\r",2); return;
+                case '\t': output_->Append("\\t",2); return;
+                case '\b': output_->Append("\\b",2); return;
+                case '\f': output_->Append("\\f",2); return;
+                default:
+                    memcpy(buf,"\\u00",4);
+                    buf[4] = kHex[cha>>4];
+                    buf[5] = kHex[cha&0xf];
+                    output_->Append(buf,6);
+                    return;
+            }
+        case FILTER_URL:
+            buf[0] = '%';
+            buf[1] = kHex[cha>>4];
+            buf[2] = kHex[cha&0xf];
+            output_->Append(buf,3);
+            return;
+        default:
+            UNREACHABLE(return);
+    }
+}
+
+// Dollar is the value of the dollar sign inside of a body. It is either a
+// Mandu or a single element of a columnar list , so iterating a columnar list
+// doesn't need any Mandu per element.
+struct Dollar {
+    enum {
+        DOLLAR_MANDU,
+        DOLLAR_INTEGER,
+        DOLLAR_STRING
+    };
+
+    Dollar( const Mandu& m , int f ):
+        type( DOLLAR_MANDU ),
+        mandu( &m ),
+        integer(0),
+        str(NULL),
+        length(0),
+        filter(f)
+    {}
+
+    Dollar( int64_t i , int f ):
+        type( DOLLAR_INTEGER ),
+        mandu( NULL ),
+        integer(i),
+        str(NULL),
+        length(0),
+        filter(f)
+    {}
+
+    Dollar( const char* s , std::size_t l , int f ):
+        type( DOLLAR_STRING ),
+        mandu( NULL ),
+        integer(0),
+        str(s),
+        length(l),
+        filter(f)
+    {}
+
+    int type;
+    const Mandu* mandu;
+    int64_t integer;
+    const char* str;
+    std::size_t length;
+    // Filter of the sentence , used when the $ doesn't have its own filter
+    int filter;
+};
+
+void AppendInteger( int64_t value , Output* output ) {
+    // Digits are written backward , no format string to parse
+    char buf[24];
+    char* p = buf + sizeof(buf);
+    uint64_t n = value < 0 ? 0 - static_cast<uint64_t>(value) : static_cast<uint64_t>(value);
+    do {
+        *--p = static_cast<char>('0' + n % 10);
+        n /= 10;
+    } while( n != 0 );
+    if( value < 0 )
+        *--p = '-';
+    output->Append( p , static_cast<std::size_t>( buf + sizeof(buf) - p ) );
+}
+
 bool IsInitialVariableChar( int cha )  {
     return cha == '_' || std::isalpha(cha);
 }
@@ -84,24 +623,24 @@ bool IsExecutorStringLiteralEscapeChar( int cha ) {
 
 class Tokenizer {
 public:
-    Tokenizer( const std::string& source , int position ) :
-        source_(&source),
+    Tokenizer( const Source& source , std::size_t position ) :
+        source_(source),
         cur_lexme_(),
         position_( position )
     {}
 
     Tokenizer():
-        source_(NULL),
+        source_(),
         cur_lexme_(),
-        position_(-1)
+        position_(0)
     {}
 
-    void Bind( const std::string& source , int position ) {
-        source_ = &source;
+    void Bind( const Source& source , std::size_t position ) {
+        source_ = source;
         Set(position);
     }
 
-    void GetLocation( int* line, int* ccount );
+    void GetLocation( std::size_t* line, std::size_t* ccount );
 
     Lexme Next() {
         return (cur_lexme_ = Peek());
@@ -113,15 +652,15 @@ public:
         return cur_lexme_;
     }
 
-    int position() const {
+    std::size_t position() const {
         return position_;
     }
 
-    const std::string& source() const {
-        return *source_;
+    const Source& source() const {
+        return source_;
     }
 
-    void Move( int offset ) {
+    void Move( std::size_t offset ) {
         position_ += offset;
         Next();
     }
@@ -131,33 +670,33 @@ public:
         Next();
     }
 
-    void Set( int pos ) {
+    void Set( std::size_t pos ) {
         position_ = pos;
         Next();
     }
 
 private:
 
-    int NextChar( int pos ) const {
-        return source_->size() <= static_cast<std::size_t>(pos) ? 0 : source_->at(pos);
+    int NextChar( std::size_t pos ) const {
+        return source_.size() <= pos ? 0 : source_.at(pos);
     }
 
     void SkipWhitespace () const ;
 
 private:
 
-    // Source pointer pointed to the source file binded to this Tokenizer
-    const std::string* source_;
+    // Source view binded to this Tokenizer
+    Source source_;
     // Current lexme for this tokenizer
     Lexme cur_lexme_;
     // Position of the current tokenizer
     mutable std::size_t position_;
 };
 
-void Tokenizer::GetLocation( int* line , int* ccount ) {
+void Tokenizer::GetLocation( std::size_t* line , std::size_t* ccount ) {
     *line = *ccount = 0;
-    for( std::size_t i = 0 ; i < position_ ; ++i ) {
-        if( source_->at(i) == '\n' ) {
+    for( std::size_t i = 0 ; i < position_ && i < source_.size() ; ++i ) {
+        if( source_.at(i) == '\n' ) {
             ++(*line);
             *ccount = 0;
         } else {
@@ -167,11 +706,11 @@ void Tokenizer::GetLocation( int* line , int* ccount ) {
 }
 
 void Tokenizer::SkipWhitespace() const {
-    int i;
+    std::size_t i;
 
-    for( i = position_ ; std::isspace( source_->at(i) ) ; ++i )
+    for( i = position_ ; i < source_.size() && std::isspace( source_.at(i) ) ; ++i )
         ;
-    position_ = static_cast<std::size_t>(i);
+    position_ = i;
 }
 
 Lexme Tokenizer::Peek() const {
@@ -202,6 +741,12 @@ Lexme Tokenizer::Peek() const {
                 return Lexme(TK_SUB,1);
             case ',':
                 return Lexme(TK_COMMA,1);
+            case '|':
+                return Lexme(TK_PIPE,1);
+            case '@':
+                return Lexme(TK_PARTIAL,1);
+            case ':':
+                return Lexme(TK_COLON,1);
             case '0':case '1':case '2':case '3':case '4':
             case '5':case '6':case '7':case '8':case '9':
                 return Lexme(TK_NUMBER,0);
@@ -223,11 +768,12 @@ Lexme Tokenizer::Peek() const {
 // variable and other stuff. This require us do a simple parse for the script
 class SectionSkipper {
 public:
-    SectionSkipper( const std::string& source , int position ):
+    SectionSkipper( const Source& source , std::size_t position ):
         tokenizer_(source,position)
         {}
-    // Skip the section body now.
-    int Skip( std::string* error );
+    // Skip the section body now. The position right after the section end
+    // will be stored inside of the end.
+    bool Skip( std::size_t* end , std::string* error );
 private:
 
     void ReportError( std::string* error , const char* format,  ... );
@@ -236,8 +782,8 @@ private:
     void SkipNumber( );
     void SkipVariable( );
 
-    bool IsStringLiteralEscapeChar( int position ) {
-        if( position < static_cast<int>( tokenizer_.source().size() ) ) {
+    bool IsStringLiteralEscapeChar( std::size_t position ) {
+        if( position < tokenizer_.source().size() ) {
             return IsExecutorStringLiteralEscapeChar(
                     tokenizer_.source().at(position) );
         } else {
@@ -245,8 +791,8 @@ private:
         }
     }
 
-    bool IsBodyEscapeChar( int position ) {
-        if( position < static_cast<int>( tokenizer_.source().size() ) ) {
+    bool IsBodyEscapeChar( std::size_t position ) {
+        if( position < tokenizer_.source().size() ) {
             return IsExecutorStringLiteralEscapeChar(
                     tokenizer_.source().at(position));
         } else {
@@ -259,7 +805,7 @@ private:
 };
 
 void SectionSkipper::ReportError( std::string* error, const char* format , ... ) {
-    int line,ccount;
+    std::size_t line,ccount;
     char msg[1024];
     va_list vl;
     std::stringstream formatter;
@@ -267,7 +813,8 @@ void SectionSkipper::ReportError( std::string* error, const char* format , ... )
     va_start(vl,format);
     tokenizer_.GetLocation(&line,&ccount);
 
-    vsprintf(msg,format,vl);
+    vsnprintf(msg,sizeof(msg),format,vl);
+    va_end(vl);
     formatter<<"[Error("<<line<<","<<ccount<<"]:"
         <<msg<<std::endl;
     error->assign( formatter.str() );
@@ -322,13 +869,13 @@ void SectionSkipper::SkipVariable( ) {
     tokenizer_.Set(i);
 }
 
-int SectionSkipper::Skip( std::string* error ) {
+bool SectionSkipper::Skip( std::size_t* end , std::string* error ) {
     do {
         Lexme l = tokenizer_.Next();
         switch(l.token) {
             case TK_STRING:
                 if(!SkipString(error))
-                    return -1;
+                    return false;
                 break;
             case TK_VARIABLE:
                 SkipVariable();
@@ -339,107 +886,596 @@ int SectionSkipper::Skip( std::string* error ) {
             case TK_SECTION_END:
                 // SectionEnd
                 tokenizer_.Move();
-                return tokenizer_.position();
+                *end = tokenizer_.position();
+                return true;
             case TK_END:
             case TK_EOF:
             case TK_UNKNOWN:
                 // This token cannot be here at the section body
                 ReportError(error,"Unexpected token or end of the file!");
-                return -1;
+                return false;
             default:
                 tokenizer_.Move();
                 break;
         }
     } while(true);
 }
-}// namespace
-
-namespace mandu {
-namespace detail {
+// Skip the segments and bodies nested inside of each other without recursion ,
+// so a deeply nested template cannot run off the stack of a cursor. The
+// levels alternate , every other level of the start is a segment or a body.
+bool SkipNested( const Source& source , std::size_t position , bool body , std::size_t* end ) {
+    std::size_t depth = 0;
+    for( std::size_t i = position ; i < source.size() ; ++i ) {
+        const bool in_body = ( depth % 2 == 0 ) == body;
+        const int cha = source.at(i);
+        if( in_body ) {
+            switch( cha ) {
+                case '\\':
+                    if( i+1 < source.size() && IsExecutorBodyEscapeChar( source.at(i+1) ) )
+                        ++i;
+                    break;
+                case '`':
+                    ++depth;
+                    break;
+                case '}':
+                    if( depth == 0 ) {
+                        *end = i+1;
+                        return true;
+                    }
+                    --depth;
+                    break;
+                default:
+                    break;
+            }
+        } else {
+            switch( cha ) {
+                case '"':
+                    // Skip the string literal
+                    for( ++i ; i < source.size() && source.at(i) != '"' ; ++i ) {
+                        if( source.at(i) == '\\' && i+1 < source.size() &&
+                            IsExecutorStringLiteralEscapeChar( source.at(i+1) ) )
+                            ++i;
+                    }
+                    if( i == source.size() )
+                        return false;
+                    break;
+                case '{':
+                    ++depth;
+                    break;
+                case '`':
+                    if( depth == 0 ) {
+                        *end = i;
+                        return true;
+                    }
+                    --depth;
+                    break;
+                default:
+                    break;
+            }
+        }
+    }
+    return false;
+}
 
-template< typename T >
-class ZoneAllocator {
-public:
-    ZoneAllocator( std::size_t cap , std::size_t max_capacity ):
-        cur_capacity_( cap < 2 ? 1 : cap/2 ),
-        max_capacity_( max_capacity ),
-        page_list_( NULL ),
-        free_list_( NULL )
-        {}
+// Find the end of a code segment without executing it , position is right
+// after the starting backtick and end is the position of the ending backtick.
+bool SkipSegment( const Source& source , std::size_t position , std::size_t* end ) {
+    return SkipNested( source , position , false , end );
+}
 
-    ~ZoneAllocator() {
-        Clear(0);
-    }
+// Find the end of a body without executing it , position is right after the
+// "{" and end is the position right after the ending "}".
+bool SkipBody( const Source& source , std::size_t position , std::size_t* end ) {
+    return SkipNested( source , position , true , end );
+}
 
-    // Grab function performs memory allocation and construction function for
-    // each memory segment. currently 3 maximum parameters are allowed. C++11
-    // can use variadic template to solve it :(
-    T* Grab() {
-        return ::new (Malloc()) T();
-    }
+// WhitespaceMinifier collapses the insignificant whitespace of a template once ,
+// so it is not paid on every cook. Only the literal text , the document and
+// the bodies , is touched. The code of the segments and the escapes are kept
+// as they are. A whitespace run becomes one newline if it contains a newline ,
+// otherwise one space. The content of pre , textarea , script and style
+// elements is kept unchanged.
+class WhitespaceMinifier {
+public:
+    WhitespaceMinifier( const Source& source , std::string* output ):
+        source_(source),
+        output_(output),
+        preserve_(NULL)
+    {}
 
-    template< typename A1 >
-    T* Grab( const A1& a1 ) {
-        return ::new (Malloc()) T(a1);
+    void Run() {
+        output_->clear();
+        output_->reserve( source_.size() );
+        std::size_t end = Literal(0,false);
+        // The template is broken , keep the rest and let the cook report it
+        output_->append( source_.data() + end , source_.size() - end );
     }
 
-    template< typename A1 , typename A2 >
-    T* Grab( const A1& a1 , const A2& a2 ) {
-        return ::new (Malloc()) T(a1,a2);
+private:
+    static bool IsSpace( int cha ) {
+        return cha == ' ' || cha == '\t' || cha == '\n' || cha == '\r';
     }
 
-    template< typename A1 , typename A2 , typename A3 >
-    T* Grab( const A1& a1 , const A2& a2 , const A3& a3 ) {
-        return ::new (Malloc()) T(a1,a2,a3);
-    }
+    // Check whether an open tag , or a close tag , of name is at position
+    bool MatchTag( std::size_t position , const char* name , bool close ) const;
 
-    // Drop function for that objects.
-    void Drop( T* ptr ) {
-        ptr->~T();
-        Free(ptr);
-    }
+    // Minify literal text starting from position. Return the position of the
+    // "}" that ends the body , or the size of the source.
+    std::size_t Literal( std::size_t position , bool body );
 
-    // Clear function will Clear the memory, as its name indicated, free all
-    // the page. To hold those memory inside of the memory, please use Reclaim
-    void Clear( std::size_t cap );
+    // Copy a segment starting right after the backtick. Return the position
+    // of the ending backtick , or the size of the source.
+    std::size_t Segment( std::size_t position );
 
-    // Reclaim will reclaim all the
-    void Reclaim();
+    const Source& source_;
+    std::string* output_;
+    // The element whose content is kept , NULL if there is none
+    const char* preserve_;
+};
 
-private:
-    void* Malloc() {
-        void* ret = free_list_;
-        if( ret == NULL ) {
-            Grow();
-        }
-        assert( free_list_ != NULL );
-        ret = free_list_ ;
-        free_list_ = free_list_->next;
-        return ret;
+bool WhitespaceMinifier::MatchTag( std::size_t position , const char* name , bool close ) const {
+    assert( source_.at(position) == '<' );
+    ++position;
+    if( close ) {
+        if( position >= source_.size() || source_.at(position) != '/' )
+            return false;
+        ++position;
     }
-
-    void Free( void* ptr ) {
-        FreeList* fl = static_cast<FreeList*>(ptr);
-        fl->next = free_list_;
-        free_list_ = fl;
+    std::size_t length = strlen(name);
+    if( position + length > source_.size() )
+        return false;
+    for( std::size_t i = 0 ; i < length ; ++i ) {
+        if( std::tolower( static_cast<unsigned char>(source_.at(position+i)) ) != name[i] )
+            return false;
     }
+    // The name must not be a prefix of a longer tag name
+    return position + length == source_.size() ||
+        !std::isalnum( static_cast<unsigned char>(source_.at(position+length)) );
+}
 
-    void Grow( void* , std::size_t );
+std::size_t WhitespaceMinifier::Literal( std::size_t position , bool body ) {
+    static const char* kPreserveTags[] = { "pre" , "textarea" , "script" , "style" };
 
-    void Grow() {
-        cur_capacity_ *= 2;
-        cur_capacity_ = std::min( cur_capacity_ , max_capacity_ );
-        void* page = malloc( cur_capacity_*Align(sizeof(T),kAlignment) + sizeof(Page) );
-        Page* p = reinterpret_cast<Page*>(page);
-        p->page_size = cur_capacity_;
-        p->next = page_list_;
-        page_list_ = p;
-        Grow( static_cast<void*>(
-                    static_cast<char*>(page) + sizeof(Page)),cur_capacity_ );
+    for( std::size_t i = position ; i < source_.size() ; ++i ) {
+        int cha = source_.at(i);
+        if( cha == '\\' ) {
+            output_->push_back('\\');
+            if( i+1 < source_.size() &&
+                (body ? IsExecutorBodyEscapeChar(source_.at(i+1)) : source_.at(i+1) == '`') )
+                output_->push_back( source_.at(++i) );
+        } else if( cha == '`' ) {
+            output_->push_back('`');
+            i = Segment(i+1);
+            if( i == source_.size() )
+                return i;
+            output_->push_back('`');
+        } else if( cha == '}' && body ) {
+            return i;
+        } else if( IsSpace(cha) && preserve_ == NULL ) {
+            bool newline = false;
+            for( ; i < source_.size() && IsSpace(source_.at(i)) ; ++i ) {
+                if( source_.at(i) == '\n' )
+                    newline = true;
+            }
+            output_->push_back( newline ? '\n' : ' ' );
+            --i;
+        } else {
+            if( cha == '<' ) {
+                if( preserve_ == NULL ) {
+                    for( std::size_t k = 0 ; k < sizeof(kPreserveTags)/sizeof(kPreserveTags[0]) ; ++k ) {
+                        if( MatchTag(i,kPreserveTags[k],false) ) {
+                            preserve_ = kPreserveTags[k];
+                            break;
+                        }
+                    }
+                } else if( MatchTag(i,preserve_,true) ) {
+                    preserve_ = NULL;
+                }
+            }
+            output_->push_back( static_cast<char>(cha) );
+        }
     }
+    return source_.size();
+}
 
-    std::size_t Align( std::size_t l , std::size_t a ) {
-        return (l+a-1) &~(a-1);
+std::size_t WhitespaceMinifier::Segment( std::size_t position ) {
+    for( std::size_t i = position ; i < source_.size() ; ++i ) {
+        int cha = source_.at(i);
+        if( cha == '`' )
+            return i;
+        output_->push_back( static_cast<char>(cha) );
+        if( cha == '"' ) {
+            // String literal is copied as it is
+            for( ++i ; i < source_.size() && source_.at(i) != '"' ; ++i ) {
+                output_->push_back( source_.at(i) );
+                if( source_.at(i) == '\\' && i+1 < source_.size() &&
+                    IsExecutorStringLiteralEscapeChar( source_.at(i+1) ) )
+                    output_->push_back( source_.at(++i) );
+            }
+            if( i == source_.size() )
+                return i;
+            output_->push_back('"');
+        } else if( cha == '{' ) {
+            i = Literal(i+1,true);
+            if( i == source_.size() )
+                return i;
+            output_->push_back('}');
+        }
+    }
+    return source_.size();
+}
+
+void MinifyWhitespace( const Source& source , std::string* output ) {
+    WhitespaceMinifier minifier(source,output);
+    minifier.Run();
+}
+}// namespace
+
+namespace mandu {
+namespace {
+// Split the top level of the text into pieces , defined with the compiled
+// templates below
+bool BuildPieces( const Source& text , std::vector<detail::TemplatePiece>* pieces ,
+        std::string* error );
+}// namespace
+
+namespace detail {
+
+// A compiled template file is laid out as the header , the piece table and the
+// template text. Only offsets are stored , so the file is used right from its
+// mapping and the same pages could be shared by many processes.
+struct TemplateHeader {
+    char magic[8];
+    uint32_t version;
+    // Written as kByteOrder , a file of the other byte order is refused
+    uint32_t byte_order;
+    uint64_t piece_offset;
+    uint64_t piece_count;
+    uint64_t text_offset;
+    uint64_t text_size;
+    uint64_t reserved[2];
+};
+
+// The top level of the template split into literal runs and code segments. A
+// literal piece never contains an escape , so it is written out as it is. A
+// segment piece starts at its opening backtick.
+struct TemplatePiece {
+    enum {
+        PIECE_LITERAL,
+        PIECE_SEGMENT
+    };
+    uint64_t offset;
+    uint64_t length;
+    uint32_t kind;
+    uint32_t reserved;
+};
+
+static const char kTemplateMagic[8] = { 'M','A','N','D','U','T','P','L' };
+static const uint32_t kTemplateVersion = 1;
+static const uint32_t kByteOrder = 0x01020304;
+
+// PageCache is where the pages of all the ZoneAllocators come from. A page is
+// rounded up to a power of two and every thread keeps the freed pages of each
+// size in a small cache , so a SoupMaker created and destroyed per request
+// doesn't go to malloc. The surplus of a thread cache goes back to a central
+// pool in one batch and an empty thread cache is refilled from there in one
+// batch as well , so the central lock is rarely taken. The central pool keeps
+// at most kCentralCacheBytes of each size , beyond that the pages go back to
+// malloc , and Trim releases all of them. Pages larger than kMaxPageShift are
+// plain mallocs.
+class PageCache {
+public:
+    static const std::size_t kMinPageShift = 10; // 1KB
+    static const std::size_t kMaxPageShift = 20; // 1MB
+    static const std::size_t kClassSize = kMaxPageShift - kMinPageShift + 1;
+    // Bytes of pages of one size kept by a thread and by the central pool
+    static const std::size_t kThreadCacheBytes = 256*1024;
+    static const std::size_t kCentralCacheBytes = 1024*1024;
+
+    // The size of the page that is really allocated for size bytes
+    static std::size_t PageSize( std::size_t size ) {
+        if( size > (static_cast<std::size_t>(1) << kMaxPageShift) )
+            return size;
+        std::size_t page = static_cast<std::size_t>(1) << kMinPageShift;
+        while( page < size )
+            page <<= 1;
+        return page;
+    }
+
+    // The size must be one returned by PageSize
+    static void* Allocate( std::size_t size ) {
+        const int cls = Class(size);
+        if( cls < 0 )
+            return malloc(size);
+        ThreadCache* cache = Local();
+        if( cache == NULL )
+            return FromCentral(cls,1);
+        if( cache->list[cls] == NULL ) {
+            cache->list[cls] = FromCentral(cls,Limit(cls)/2);
+            cache->count[cls] = Length(cache->list[cls]);
+        }
+        FreePage* page = cache->list[cls];
+        cache->list[cls] = page->next;
+        --cache->count[cls];
+        return page;
+    }
+
+    static void Deallocate( void* ptr , std::size_t size ) {
+        const int cls = Class(size);
+        if( cls < 0 ) {
+            free(ptr);
+            return;
+        }
+        FreePage* page = static_cast<FreePage*>(ptr);
+        page->next = NULL;
+        ThreadCache* cache = Local();
+        if( cache == NULL ) {
+            ToCentral(cls,page);
+            return;
+        }
+        page->next = cache->list[cls];
+        cache->list[cls] = page;
+        if( ++cache->count[cls] > Limit(cls) ) {
+            // Keep half of the cache and give the rest back in one go
+            std::size_t keep = Limit(cls)/2;
+            FreePage* tail = cache->list[cls];
+            for( std::size_t i = 1 ; i < keep ; ++i )
+                tail = tail->next;
+            FreePage* batch = tail->next;
+            tail->next = NULL;
+            ToCentral(cls,batch);
+            cache->count[cls] = keep;
+        }
+    }
+
+    // Free the pages cached by the calling thread and the central pool , the
+    // caches of the other threads are kept
+    static void Trim() {
+        ThreadCache* cache = Local();
+        for( std::size_t i = 0 ; i < kClassSize ; ++i ) {
+            FreePage* pages = NULL;
+            if( cache != NULL ) {
+                pages = cache->list[i];
+                cache->list[i] = NULL;
+                cache->count[i] = 0;
+            }
+            FreeAll(pages);
+
+            Central* c = central() + i;
+            {
+                std::lock_guard<std::mutex> guard(c->mutex);
+                pages = c->list;
+                c->list = NULL;
+                c->count = 0;
+            }
+            FreeAll(pages);
+        }
+    }
+
+private:
+    struct FreePage {
+        FreePage* next;
+    };
+
+    static void FreeAll( FreePage* pages ) {
+        while( pages != NULL ) {
+            FreePage* next = pages->next;
+            free(pages);
+            pages = next;
+        }
+    }
+
+    struct ThreadCache {
+        FreePage* list[kClassSize];
+        std::size_t count[kClassSize];
+
+        ThreadCache() {
+            for( std::size_t i = 0 ; i < kClassSize ; ++i ) {
+                list[i] = NULL;
+                count[i] = 0;
+            }
+        }
+
+        ~ThreadCache();
+    };
+
+    struct Central {
+        std::mutex mutex;
+        FreePage* list;
+        std::size_t count;
+    };
+
+    static int Class( std::size_t size ) {
+        if( size > (static_cast<std::size_t>(1) << kMaxPageShift) )
+            return -1;
+        int cls = 0;
+        while( (static_cast<std::size_t>(1) << (kMinPageShift+cls)) < size )
+            ++cls;
+        return cls;
+    }
+
+    static std::size_t Limit( int cls ) {
+        std::size_t limit = kThreadCacheBytes >> (kMinPageShift+cls);
+        return limit < 2 ? 2 : limit;
+    }
+
+    static std::size_t Length( FreePage* page ) {
+        std::size_t length = 0;
+        for( ; page != NULL ; page = page->next )
+            ++length;
+        return length;
+    }
+
+    // NULL once the cache of the thread is destroyed , a ZoneAllocator that is
+    // destroyed later at the thread exit uses the central pool directly
+    static ThreadCache* Local() {
+        if( Destroyed() )
+            return NULL;
+        static thread_local ThreadCache cache;
+        return &cache;
+    }
+
+    static bool& Destroyed() {
+        static thread_local bool destroyed = false;
+        return destroyed;
+    }
+
+    static Central* central() {
+        // Never destroyed , threads may exit during the static destruction
+        static Central* central = new Central[kClassSize]();
+        return central;
+    }
+
+    // Take at most count pages , a page is malloced if the pool is empty
+    static FreePage* FromCentral( int cls , std::size_t count ) {
+        Central* c = central() + cls;
+        FreePage* ret = NULL;
+        {
+            std::lock_guard<std::mutex> guard(c->mutex);
+            for( std::size_t i = 0 ; i < count && c->list != NULL ; ++i ) {
+                FreePage* page = c->list;
+                c->list = page->next;
+                page->next = ret;
+                ret = page;
+                --c->count;
+            }
+        }
+        if( ret == NULL ) {
+            ret = static_cast<FreePage*>(
+                    malloc( static_cast<std::size_t>(1) << (kMinPageShift+cls) ));
+            ret->next = NULL;
+        }
+        return ret;
+    }
+
+    static void ToCentral( int cls , FreePage* pages ) {
+        const std::size_t limit = kCentralCacheBytes >> (kMinPageShift+cls);
+        Central* c = central() + cls;
+        FreePage* overflow = NULL;
+        {
+            std::lock_guard<std::mutex> guard(c->mutex);
+            while( pages != NULL ) {
+                FreePage* next = pages->next;
+                if( c->count < limit ) {
+                    pages->next = c->list;
+                    c->list = pages;
+                    ++c->count;
+                } else {
+                    pages->next = overflow;
+                    overflow = pages;
+                }
+                pages = next;
+            }
+        }
+        FreeAll(overflow);
+    }
+};
+
+inline PageCache::ThreadCache::~ThreadCache() {
+    for( std::size_t i = 0 ; i < kClassSize ; ++i ) {
+        if( list[i] != NULL )
+            ToCentral( static_cast<int>(i) , list[i] );
+    }
+    Destroyed() = true;
+}
+
+template< typename T >
+class ZoneAllocator {
+public:
+    ZoneAllocator( std::size_t cap , std::size_t max_capacity ):
+        cur_capacity_( cap < 2 ? 1 : cap/2 ),
+        max_capacity_( max_capacity ),
+        page_list_( NULL ),
+        free_list_( NULL ),
+        free_count_(0)
+        {}
+
+    ~ZoneAllocator() {
+        Clear(0);
+    }
+
+    // Grab function performs memory allocation and construction function for
+    // each memory segment. The arguments are perfect forwarded to the
+    // constructor , so a temporary argument is moved instead of copied.
+    template< typename... Args >
+    T* Grab( Args&&... args ) {
+        return ::new (Malloc()) T( std::forward<Args>(args)... );
+    }
+
+    // Drop function for that objects.
+    void Drop( T* ptr ) {
+        ptr->~T();
+        Free(ptr);
+    }
+
+    // Make sure count objects could be grabbed without a malloc , the missing
+    // ones are allocated as one page.
+    void Reserve( std::size_t count ) {
+        if( free_count_ >= count )
+            return;
+        std::size_t size = count - free_count_;
+        if( size > max_capacity_ )
+            size = max_capacity_;
+        NewPage( size );
+    }
+
+    // The largest page Grow allocates
+    void set_max_capacity( std::size_t max_capacity ) {
+        max_capacity_ = max_capacity < 1 ? 1 : max_capacity;
+    }
+
+    // Clear function will Clear the memory, as its name indicated, free all
+    // the page. To hold those memory inside of the memory, please use Reclaim
+    void Clear( std::size_t cap );
+
+    // Reclaim will reclaim all the
+    void Reclaim();
+
+private:
+    void* Malloc() {
+        void* ret = free_list_;
+        if( ret == NULL ) {
+            Grow();
+        }
+        assert( free_list_ != NULL );
+        ret = free_list_ ;
+        free_list_ = free_list_->next;
+        --free_count_;
+        return ret;
+    }
+
+    void Free( void* ptr ) {
+        FreeList* fl = static_cast<FreeList*>(ptr);
+        fl->next = free_list_;
+        free_list_ = fl;
+        ++free_count_;
+    }
+
+    void Grow( void* , std::size_t );
+
+    void Grow() {
+        cur_capacity_ *= 2;
+        cur_capacity_ = std::min( cur_capacity_ , max_capacity_ );
+        NewPage( cur_capacity_ );
+    }
+
+    // The page is rounded up by the PageCache , the slack is used as objects
+    void NewPage( std::size_t size ) {
+        const std::size_t bytes = PageCache::PageSize(
+                size*Align(sizeof(T),kAlignment) + sizeof(Page) );
+        size = (bytes - sizeof(Page)) / Align(sizeof(T),kAlignment);
+        void* page = PageCache::Allocate( bytes );
+        Page* p = reinterpret_cast<Page*>(page);
+        p->page_size = size;
+        p->page_bytes = bytes;
+        p->next = page_list_;
+        page_list_ = p;
+        Grow( static_cast<void*>(
+                    static_cast<char*>(page) + sizeof(Page)),size );
+    }
+
+    std::size_t Align( std::size_t l , std::size_t a ) {
+        return (l+a-1) &~(a-1);
     }
 
 private:
@@ -462,12 +1498,14 @@ private:
     // sizeof(Page).
     struct Page {
         std::size_t page_size;
+        std::size_t page_bytes;
         struct Page* next;
     };
 
     Page* page_list_;
 
     FreeList* free_list_;
+    std::size_t free_count_;
 };
 
 template< typename T >
@@ -482,6 +1520,7 @@ void ZoneAllocator<T>::Grow( void* mem , std::size_t sz ) {
     }
     fl->next = free_list_;
     free_list_ = static_cast<FreeList*>(head);
+    free_count_ += sz;
 }
 
 template< typename T >
@@ -489,11 +1528,12 @@ void ZoneAllocator<T>::Clear( std::size_t sz ) {
     Page* p = page_list_;
     while(p) {
         page_list_ = p->next;
-        free(p);
+        PageCache::Deallocate( p , p->page_bytes );
         p = page_list_;
     }
     page_list_ = NULL;
     free_list_ = NULL;
+    free_count_ = 0;
     cur_capacity_ = sz/2;
 }
 
@@ -509,17 +1549,229 @@ void ZoneAllocator<T>::Reclaim() {
 
 namespace {
 
+// SymbolTable interns the variable and section names of all the SoupMakers of
+// the process. A name is stored once and becomes a small integer , so the
+// variable map compares integers. Intern takes a lock , Find and Name never
+// do , the chains of the hash table are only prepended and a grown table is
+// published atomically. The replaced tables are kept since a reader may still
+// walk them. Nothing is ever removed , so the names must come from a fixed set.
+class SymbolTable {
+public:
+    static const int kNoSymbol = -1;
+
+    static SymbolTable* Instance() {
+        // Never destroyed , a cook may run during the static destruction
+        static SymbolTable* instance = new SymbolTable();
+        return instance;
+    }
+
+    // Return the symbol of the name , it is added if it is new
+    int Intern( const char* name , std::size_t length );
+    int Intern( const std::string& name ) {
+        return Intern( name.data() , name.size() );
+    }
+
+    // Return the symbol of the name , kNoSymbol if it is never interned
+    int Find( const char* name , std::size_t length ) const;
+    int Find( const std::string& name ) const {
+        return Find( name.data() , name.size() );
+    }
+
+    // Name of a symbol , it is valid as long as the process
+    const std::string& Name( int symbol ) const;
+
+private:
+    static const std::size_t kInitialBuckets = 1024;
+
+    // The names are stored by symbol in chunks that never move , chunk k
+    // holds kFirstChunk << k names
+    static const std::size_t kFirstChunk = 1024;
+    static const int kFirstChunkBits = 10;
+    static const int kMaxChunks = 22;
+
+    struct Node {
+        const std::string* name;
+        uint32_t hash;
+        int symbol;
+        Node* next;
+    };
+
+    struct Table {
+        std::size_t mask;
+        std::atomic<Node*>* buckets;
+    };
+
+    SymbolTable():
+        size_(0)
+    {
+        table_.store( NewTable( kInitialBuckets ) , std::memory_order_relaxed );
+        for( int i = 0 ; i < kMaxChunks ; ++i ) {
+            chunks_[i].store( NULL , std::memory_order_relaxed );
+        }
+    }
+
+    // Chunk and index inside of it of a symbol
+    static int ChunkOf( std::size_t symbol , std::size_t* index ) {
+        std::size_t n = symbol + kFirstChunk;
+        int chunk = 63 - __builtin_clzll( static_cast<unsigned long long>(n) ) - kFirstChunkBits;
+        *index = n - ( kFirstChunk << chunk );
+        return chunk;
+    }
+
+    static uint32_t Hash( const char* name , std::size_t length ) {
+        // FNV-1a
+        uint32_t hash = 2166136261U;
+        for( std::size_t i = 0 ; i < length ; ++i ) {
+            hash ^= static_cast<unsigned char>(name[i]);
+            hash *= 16777619U;
+        }
+        return hash;
+    }
+
+    static Table* NewTable( std::size_t buckets ) {
+        Table* table = new Table();
+        table->mask = buckets - 1;
+        table->buckets = new std::atomic<Node*>[buckets];
+        for( std::size_t i = 0 ; i < buckets ; ++i ) {
+            table->buckets[i].store( NULL , std::memory_order_relaxed );
+        }
+        return table;
+    }
+
+    static const Node* Lookup( const Table* table , const char* name ,
+            std::size_t length , uint32_t hash ) {
+        const Node* node = table->buckets[ hash & table->mask ].load( std::memory_order_acquire );
+        for( ; node != NULL ; node = node->next ) {
+            if( node->hash == hash && node->name->size() == length &&
+                memcmp( node->name->data() , name , length ) == 0 )
+                return node;
+        }
+        return NULL;
+    }
+
+    static void Link( Table* table , Node* node ) {
+        std::atomic<Node*>& bucket = table->buckets[ node->hash & table->mask ];
+        node->next = bucket.load( std::memory_order_relaxed );
+        bucket.store( node , std::memory_order_release );
+    }
+
+    std::atomic<Table*> table_;
+    std::atomic<const std::string**> chunks_[kMaxChunks];
+
+    // Guard of the writers , all the members below are only used under it
+    std::mutex lock_;
+    std::size_t size_;
+    std::vector<Table*> retired_;
+};
+
+int SymbolTable::Find( const char* name , std::size_t length ) const {
+    const Node* node = Lookup( table_.load( std::memory_order_acquire ) ,
+            name , length , Hash(name,length) );
+    return node == NULL ? kNoSymbol : node->symbol;
+}
+
+int SymbolTable::Intern( const char* name , std::size_t length ) {
+    uint32_t hash = Hash(name,length);
+    const Node* found = Lookup( table_.load( std::memory_order_acquire ) , name , length , hash );
+    if( found != NULL )
+        return found->symbol;
+
+    std::lock_guard<std::mutex> guard(lock_);
+    Table* table = table_.load( std::memory_order_relaxed );
+    // Another writer may have added it
+    found = Lookup( table , name , length , hash );
+    if( found != NULL )
+        return found->symbol;
+
+    Node* node = new Node();
+    node->name = new std::string(name,length);
+    node->hash = hash;
+    // The name is stored before the node is published , a reader that finds
+    // the symbol sees it
+    std::size_t index;
+    int chunk = ChunkOf( size_ , &index );
+    assert( chunk < kMaxChunks );
+    const std::string** names = chunks_[chunk].load( std::memory_order_relaxed );
+    if( names == NULL ) {
+        names = new const std::string*[ kFirstChunk << chunk ];
+        chunks_[chunk].store( names , std::memory_order_release );
+    }
+    names[index] = node->name;
+    node->symbol = static_cast<int>(size_++);
+
+    if( size_ > table->mask + 1 ) {
+        // Grow the table , the nodes are copied since the chains of the old
+        // table could still be walked by the readers
+        Table* grown = NewTable( (table->mask + 1) * 2 );
+        for( std::size_t i = 0 ; i <= table->mask ; ++i ) {
+            for( Node* n = table->buckets[i].load( std::memory_order_relaxed ) ;
+                    n != NULL ; n = n->next ) {
+                Node* copy = new Node(*n);
+                Link( grown , copy );
+            }
+        }
+        Link( grown , node );
+        retired_.push_back( table );
+        table_.store( grown , std::memory_order_release );
+    } else {
+        Link( table , node );
+    }
+    return node->symbol;
+}
+
+const std::string& SymbolTable::Name( int symbol ) const {
+    assert( symbol >= 0 );
+    std::size_t index;
+    int chunk = ChunkOf( static_cast<std::size_t>(symbol) , &index );
+    return *chunks_[chunk].load( std::memory_order_acquire )[index];
+}
 
 class VariableMap {
 public:
-    bool IsSectionEnabled( const std::string& section ) const;
-    bool SetSectionEnable( const std::string& section , bool value );
-    
-    Mandu* FindMandu( const std::string& section , const std::string& key ) const;
-    Mandu* FindMandu( const std::string& key ) const;
+    // The section of the global variables
+    static const int kGlobal = SymbolTable::kNoSymbol;
+
+    // Value slot of a variable. A variable with a provider is computed lazily,
+    // if it is memoized the result is stored inside of the mandu.
+    struct Value {
+        Mandu* mandu;
+        VariableProvider* provider;
+        // Name of the variable passed to the provider
+        const std::string* name;
+        bool memoize;
+        bool resolved;
+
+        explicit Value( Mandu* m ):
+            mandu(m),
+            provider(NULL),
+            name(NULL),
+            memoize(false),
+            resolved(false)
+        {}
+    };
+
+    // Sections and keys are symbols of the SymbolTable
+    bool IsSectionEnabled( int section ) const;
+    bool SetSectionEnable( int section , bool value );
+
+    // Find the value slot , -1 is returned if not found
+    int FindValue( int section , int key ) const;
+    int FindValue( int key ) const {
+        return FindValue( kGlobal , key );
+    }
+
+    // Insert the mandu and return the mandu that is replaced. Binding a key
+    // to a mandu removes its provider.
+    Mandu* InsertMandu( int key , Mandu* m ) {
+        return InsertValue( MakeKey(kGlobal,key) , m );
+    }
+    Mandu* InsertMandu( int sec , int key , Mandu* m );
+
+    // Whether the section is known to this map , enabled or not
+    bool HasSection( int section ) const;
 
-    Mandu* InsertMandu( const std::string& key , Mandu* m );
-    Mandu* InsertMandu( const std::string& sec , const std::string& key , Mandu* m );
+    // Add the section without any variable
+    void InsertSection( int section , bool enable );
 
     void Clear() {
         kv_map_.clear();
@@ -532,63 +1784,58 @@ public:
         return values_.size();
     }
 
-    Mandu* mandu( std::size_t index ) {
+    Mandu* mandu( std::size_t index ) const {
+        return values_[index].mandu;
+    }
+
+    Value& value( std::size_t index ) {
         return values_[index];
     }
 
 private:
-    static const char kIndent = '$';
-
-    std::string MakeKeyValueKey( const std::string& section , const std::string& key ) const {
-        std::string ret(section);
-        ret.push_back( kIndent );
-        ret.append(key);
-        return ret;
+    // The section and the key are packed into one integer , so a lookup is a
+    // binary search over integers
+    static uint64_t MakeKey( int section , int key ) {
+        return ( static_cast<uint64_t>( static_cast<uint32_t>(section+1) ) << 32 ) |
+            static_cast<uint32_t>(key);
     }
 
     struct KeyValuePair {
-        std::string key;
+        uint64_t key;
         int value;
-        bool operator < ( const std::string& k ) const {
-            return key < k; 
+        bool operator < ( uint64_t k ) const {
+            return key < k;
         }
-        KeyValuePair() : 
-            key(),
-            value(-1)
-        {}
-        KeyValuePair( const std::string& k , int v ) :
+        KeyValuePair( uint64_t k , int v ) :
             key(k),
             value(v)
         {}
     };
 
     struct SectionKey {
-        std::string section;
+        int section;
         bool enable;
-        SectionKey():
-            section(),
-            enable(false)
-        {}
-
-        SectionKey( const std::string& s , bool e ) :
+        SectionKey( int s , bool e ) :
             section(s),
             enable(e)
         {}
 
-        bool operator < ( const std::string& sec_key ) const {
+        bool operator < ( int sec_key ) const {
             return section < sec_key;
         }
     };
 
     typedef std::vector< KeyValuePair > KeyValueMap;
     typedef std::vector< SectionKey > SectionMap;
+    Mandu* InsertValue( uint64_t kv_key , Mandu* m );
+
     KeyValueMap kv_map_;
     SectionMap section_map_;
-    std::vector<Mandu*> values_;
+    std::vector<Value> values_;
 };
 
 
-Mandu* VariableMap::InsertMandu( const std::string& sec , const std::string& key , Mandu* m ) {
+Mandu* VariableMap::InsertMandu( int sec , int key , Mandu* m ) {
     // Find out if we have already put such section into our map
     SectionMap::iterator sec_iter = std::lower_bound( 
             section_map_.begin(),section_map_.end(),sec);
@@ -597,62 +1844,55 @@ Mandu* VariableMap::InsertMandu( const std::string& sec , const std::string& key
         section_map_.insert( sec_iter, SectionKey(sec,true) );
     }
     // Now insert this value into the kv_map_
-    const std::string kv_key = MakeKeyValueKey(sec,key);
+    return InsertValue( MakeKey(sec,key) , m );
+}
+
+Mandu* VariableMap::InsertValue( uint64_t kv_key , Mandu* m ) {
     KeyValueMap::iterator kv_iter = std::lower_bound( 
             kv_map_.begin(),kv_map_.end(),kv_key);
     Mandu* ret = m;
 
     if( kv_iter == kv_map_.end() || kv_iter->key != kv_key ) {
-        values_.push_back( m );
+        values_.push_back( Value(m) );
         kv_map_.insert( kv_iter , KeyValuePair(kv_key,values_.size()-1) );
     } else {
-        Mandu*& p = values_[kv_iter->value];
-        ret = p;
-        p = m;
+        Value& p = values_[kv_iter->value];
+        ret = p.mandu;
+        p = Value(m);
     }
 
     return ret;
 }
 
-
-Mandu* VariableMap::InsertMandu( const std::string& key , Mandu* m ) {
-    Mandu* ret = m;
-    KeyValueMap::iterator kv_iter = std::lower_bound(
-            kv_map_.begin(),kv_map_.end(),key);
-    if( kv_iter == kv_map_.end() || kv_iter->key != key ) {
-        values_.push_back( m );
-        kv_map_.insert( kv_iter , KeyValuePair(key,values_.size()-1) );
-    } else {
-        Mandu*& p = values_[kv_iter->value];
-        ret = p;
-        p = m;
-    }
-    return ret;
-}
-
-Mandu* VariableMap::FindMandu( const std::string& section , const std::string& key ) const {
-    assert( IsSectionEnabled(section) );
-    const std::string kv_key = MakeKeyValueKey(section,key);
+int VariableMap::FindValue( int section , int key ) const {
+    const uint64_t kv_key = MakeKey(section,key);
 
     KeyValueMap::const_iterator iter = std::lower_bound( 
             kv_map_.begin(),kv_map_.end(), kv_key );
 
     if( iter == kv_map_.end() || iter->key != kv_key )
-        return NULL;
+        return -1;
     else {
-        return values_[iter->value];
+        return iter->value;
     }
 }
 
-Mandu* VariableMap::FindMandu( const std::string& key ) const {
-    KeyValueMap::const_iterator iter = std::lower_bound(
-            kv_map_.begin(),kv_map_.end(),key);
+bool VariableMap::HasSection( int section ) const {
+    SectionMap::const_iterator iter = std::lower_bound(
+            section_map_.begin(), section_map_.end() , section );
+    return iter != section_map_.end() && iter->section == section;
+}
 
-    return (iter == kv_map_.end() || iter->key != key) ? NULL :
-        values_[iter->value];
+void VariableMap::InsertSection( int section , bool enable ) {
+    SectionMap::iterator iter = std::lower_bound(
+            section_map_.begin(), section_map_.end() , section );
+    if( iter == section_map_.end() || iter->section != section )
+        section_map_.insert( iter , SectionKey(section,enable) );
+    else
+        iter->enable = enable;
 }
 
-bool VariableMap::IsSectionEnabled( const std::string& section ) const {
+bool VariableMap::IsSectionEnabled( int section ) const {
     SectionMap::const_iterator iter = std::lower_bound(
             section_map_.begin(), section_map_.end() , section );
     if( iter == section_map_.end() || iter->section != section )
@@ -662,7 +1902,7 @@ bool VariableMap::IsSectionEnabled( const std::string& section ) const {
     }
 }
 
-bool VariableMap::SetSectionEnable( const std::string& section , bool value ) {
+bool VariableMap::SetSectionEnable( int section , bool value ) {
     SectionMap::iterator iter = std::lower_bound(
             section_map_.begin(), section_map_.end() , section );
     if( iter == section_map_.end() || iter->section != section )
@@ -674,372 +1914,2153 @@ bool VariableMap::SetSectionEnable( const std::string& section , bool value ) {
 }
 } // namespace
 
-class Executor {
+// Profiler records the call tree of the segments , bodies , partials and
+// providers while the executor runs , see SoupMaker::EnableProfiling. A node
+// is found by its key among the children of the current node , so the tree
+// only grows with the distinct call paths.
+class Profiler {
 public:
-    static const std::size_t kMemoryPoolInitialSize = 64;
-    static const std::size_t kMemoryPoolMaximumSize = 512;
-
-    Executor():
-        mandu_pool_( kMemoryPoolInitialSize , kMemoryPoolMaximumSize )
-        {}
+    enum {
+        FRAME_COOK,
+        FRAME_SEGMENT,
+        FRAME_BODY,
+        FRAME_PARTIAL,
+        FRAME_PROVIDER
+    };
 
-    ~Executor() {
-        Clear();
+    Profiler():
+        nodes_(),
+        frames_(),
+        bytes_(0),
+        allocations_(0)
+    {
+        Reset();
     }
 
-    // Delegate function
-    bool IsSectionEnabled( const std::string& section_key ) const;
-    bool EnableSection( const std::string& section_key );
-    bool DisableSection( const std::string& section_key );
+    // Enter a frame , the label is only made when the node is new. For the
+    // segments and the bodies it is the location of position inside of the
+    // source , otherwise it is the name.
+    void Enter( int kind , uint64_t key , const Source& source , std::size_t position ,
+            const std::string* name );
+    void Leave();
 
-    Mandu* NewMandu( const std::string& section_key , const std::string& key );
-    Mandu* NewMandu( const std::string& key );
-    Mandu* NewMandu();
+    void CountBytes( std::size_t length ) {
+        bytes_ += length;
+    }
 
-    void FreeMandu( Mandu* mandu ) {
-        mandu_pool_.Drop(mandu);
+    void CountAllocation() {
+        ++allocations_;
     }
 
-    void Clear();
+    // Write the tree as folded stacks , one line per call path with the
+    // metric of the path itself , the metric is one of SoupMaker::PROFILE_XXX
+    void Dump( int metric , std::string* output ) const;
 
-    bool Cook( const std::string& text , std::string* output , std::string* error );
+    void Reset() {
+        nodes_.assign( 1 , Node() );
+        nodes_[0].label = "cook";
+        frames_.clear();
+    }
 
 private:
-    int CookSegment( const std::string& text , int position , std::string* appender, std::string* error );
+    static uint64_t Now() {
+        return static_cast<uint64_t>( std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now().time_since_epoch() ).count() );
+    }
 
-    void ReportError( std::string* error , const char* format , ... );
+    struct Node {
+        int kind;
+        uint64_t key;
+        std::string label;
+        std::size_t parent;
+        std::vector<std::size_t> children;
+        uint64_t count;
+        uint64_t time;
+        uint64_t bytes;
+        uint64_t allocations;
+
+        Node():
+            kind(FRAME_COOK),
+            key(0),
+            label(),
+            parent(0),
+            children(),
+            count(0),
+            time(0),
+            bytes(0),
+            allocations(0)
+        {}
+    };
 
-    bool ParseString( Mandu* output , std::string* error );
-    bool ParseNumber( Mandu* number , std::string* error );
-    bool ParseVariable( const std::string& section , Mandu* var , std::string* error );
-    bool ParseAtomic( const std::string& section , Mandu* val , std::string* error );
+    struct Frame {
+        std::size_t node;
+        uint64_t time;
+        uint64_t bytes;
+        uint64_t allocations;
+    };
 
-    enum {
-        ELEMENT_RANGE,
-        ELEMENT_ATOMIC,
-        ELEMENT_LIST,
-        ELEMENT_FAIL
-    };
+    uint64_t Metric( const Node& node , int metric ) const;
 
-    // This function will parse the list element in different format.
-    // The return value can be used to decide which type of list elements has been
-    // processed. Additionally, for element that is a list, the outputs array will
-    // be pushed on top of it.
-    int ParseListElement( const std::string& section , Mandu* from ,
-            Mandu* to , std::vector<Mandu*>* outputs , std::string* error );
+    std::vector<Node> nodes_;
+    std::vector<Frame> frames_;
+    // Running totals , a frame takes the difference
+    uint64_t bytes_;
+    uint64_t allocations_;
+};
 
-    bool ParseList( const std::string& section, std::vector<Mandu*>* outputs, std::string* error );
+void Profiler::Enter( int kind , uint64_t key , const Source& source ,
+        std::size_t position , const std::string* name ) {
+    std::size_t parent = frames_.empty() ? 0 : frames_.back().node;
+    std::size_t node = 0;
+    bool found = false;
+
+    for( std::vector<std::size_t>::const_iterator i = nodes_[parent].children.begin() ;
+            i != nodes_[parent].children.end() ; ++i ) {
+        if( nodes_[*i].kind == kind && nodes_[*i].key == key ) {
+            node = *i;
+            found = true;
+            break;
+        }
+    }
 
-    bool ExecuteList( const std::string& section , std::vector<std::string>* output , std::string* error );
-    bool ExecuteListBody( const std::string& source, int position , int* offset ,
-            const std::vector<Mandu*>& lists, std::vector<std::string>* output , std::string* error );
-    bool ExecuteAtomic( const std::string& section , std::vector<std::string>* output , std::string* error );
-    bool ExecuteBody( const Mandu& dollar_value , const std::string& source, int position , int* offset ,
-            std::string* output , std::string* error );
-    bool Execute( std::vector<std::string>* output , std::string* error );
+    if( !found ) {
+        static const char* kKindNames[] = { "template" , "segment" , "body" , "partial" , "provider" };
+        std::ostringstream formatter;
+        formatter << kKindNames[kind];
+        if( name != NULL ) {
+            formatter << ' ' << *name;
+        } else if( kind == FRAME_COOK ) {
+            formatter << ' ' << source.size() << 'B';
+        } else {
+            std::size_t line , column;
+            Tokenizer tokenizer(source,position);
+            tokenizer.GetLocation(&line,&column);
+            formatter << ' ' << line << ':' << column;
+        }
+        node = nodes_.size();
+        nodes_.push_back( Node() );
+        nodes_[node].kind = kind;
+        nodes_[node].key = key;
+        nodes_[node].label = formatter.str();
+        nodes_[node].parent = parent;
+        nodes_[parent].children.push_back(node);
+    }
 
-    // Executes the template with the output for a list , at very last
-    // we will start to do concatenation
-    bool DoExecute( std::string* output , std::string* error );
+    Frame frame = { node , Now() , bytes_ , allocations_ };
+    frames_.push_back(frame);
+}
 
-    bool LookUpVariable( const std::string& section_name , const std::string& variable_name , Mandu* mandu ) const;
+void Profiler::Leave() {
+    assert( !frames_.empty() );
+    const Frame& frame = frames_.back();
+    Node& node = nodes_[frame.node];
+    ++node.count;
+    node.time += Now() - frame.time;
+    node.bytes += bytes_ - frame.bytes;
+    node.allocations += allocations_ - frame.allocations;
+    frames_.pop_back();
+}
 
-    void Concatenate( const std::vector<std::string>& input, std::string* output );
+uint64_t Profiler::Metric( const Node& node , int metric ) const {
+    if( metric == SoupMaker::PROFILE_CALLS )
+        return node.count;
+
+    // Folded stacks want the value of the path itself , so the children are
+    // taken out of the inclusive value
+    uint64_t Node::*field = metric == SoupMaker::PROFILE_BYTES ? &Node::bytes :
+        metric == SoupMaker::PROFILE_ALLOCATIONS ? &Node::allocations : &Node::time;
+    uint64_t value = node.*field;
+    for( std::vector<std::size_t>::const_iterator i = node.children.begin() ;
+            i != node.children.end() ; ++i ) {
+        uint64_t child = nodes_[*i].*field;
+        value = value > child ? value - child : 0;
+    }
+    return metric == SoupMaker::PROFILE_TIME ? value / 1000 : value;
+}
 
-private:
-    bool IsBodyEscapeChar( int position ) {
-        if( position < static_cast<int>(
-                    tokenizer_.source().size()) ) {
-            return IsExecutorBodyEscapeChar( tokenizer_.source().at(position) );
-        } else {
-            return false;
+void Profiler::Dump( int metric , std::string* output ) const {
+    output->clear();
+    std::vector<const std::string*> stack;
+    for( std::size_t i = 1 ; i < nodes_.size() ; ++i ) {
+        uint64_t value = Metric( nodes_[i] , metric );
+        if( value == 0 )
+            continue;
+        stack.clear();
+        for( std::size_t n = i ; n != 0 ; n = nodes_[n].parent ) {
+            stack.push_back( &nodes_[n].label );
+        }
+        for( std::vector<const std::string*>::reverse_iterator s = stack.rbegin() ;
+                s != stack.rend() ; ++s ) {
+            if( s != stack.rbegin() )
+                output->push_back(';');
+            output->append( **s );
         }
+        std::ostringstream formatter;
+        formatter << ' ' << value << '\n';
+        output->append( formatter.str() );
     }
+}
 
-    bool IsStringLiteralEscapeChar( int position ) {
-        if( position < static_cast<int>(
-                    tokenizer_.source().size()) ) {
-            return IsExecutorStringLiteralEscapeChar( tokenizer_.source().at(position) );
-        } else {
-            return false;
-        }
+// ProfileScope enters a frame for its lifetime , it does nothing at all when
+// the profiler is NULL.
+class ProfileScope {
+public:
+    ProfileScope( Profiler* profiler , int kind , uint64_t key , const Source& source ,
+            std::size_t position , const std::string* name = NULL ):
+        profiler_(profiler)
+    {
+        if( profiler_ != NULL )
+            profiler_->Enter(kind,key,source,position,name);
+    }
+
+    ~ProfileScope() {
+        if( profiler_ != NULL )
+            profiler_->Leave();
     }
 
 private:
-    // Internally manage all the mandu memory allocation
-    ZoneAllocator<Mandu> mandu_pool_;
+    Profiler* profiler_;
+};
 
-    // Map for holding the variables
-    VariableMap variable_map_;
+// ProfileOutput counts the bytes written out for the profiler
+class ProfileOutput : public Output {
+public:
+    ProfileOutput( Output* output , Profiler* profiler ):
+        output_(output),
+        profiler_(profiler)
+    {}
 
-    // For those mandu that _doesn't_ have any related key or section, we just put it
-    // into the orphand list. To record these mandus are useful,since we need to clear
-    // those mandus once we are done
-    std::vector<Mandu*> orphand_mandus_;
+    virtual void Append( const char* str , std::size_t length ) {
+        profiler_->CountBytes(length);
+        output_->Append(str,length);
+    }
 
+    virtual void AppendLiteral( const char* str , std::size_t length ) {
+        profiler_->CountBytes(length);
+        output_->AppendLiteral(str,length);
+    }
 
-    // Tokenizer for this executor
-    Tokenizer tokenizer_;
+private:
+    Output* output_;
+    Profiler* profiler_;
 };
 
+// ScopeImpl is the variable set of a Scope. It only holds plain values , so
+// once it is frozen nothing inside of it is written anymore.
+class ScopeImpl {
+public:
+    static const std::size_t kMemoryPoolInitialSize = 64;
+    static const std::size_t kMemoryPoolMaximumSize = 512;
 
-void Executor::ReportError( std::string* error, const char* format , ... ) {
-    int line,ccount;
-    char msg[1024];
-    va_list vl;
-    std::stringstream formatter;
-
-    va_start(vl,format);
-    tokenizer_.GetLocation(&line,&ccount);
-
-    vsprintf(msg,format,vl);
-    formatter<<"[Error("<<line<<","<<ccount<<"]:"
-        <<msg<<std::endl;
-    error->assign( formatter.str() );
-}
+    ScopeImpl():
+        mandu_pool_( kMemoryPoolInitialSize , kMemoryPoolMaximumSize ),
+        frozen_( false )
+    {}
 
-int Executor::CookSegment( const std::string& text, int position , std::string* output, std::string* error ) {
-    assert( text[position] == '`' );
-    tokenizer_.Bind(text,position+1);
-    if( !DoExecute(output,error) ) {
-        return -1;
-    } else {
-        if( tokenizer_.cur_lexme().token != TK_END ) {
-            ReportError(error,"Expect \"`\" to end the code body");
-            return -1;
-        } else {
-            return tokenizer_.position();
+    ~ScopeImpl() {
+        for( std::size_t i = 0 ; i < variable_map_.mandu_map_size() ; ++i ) {
+            mandu_pool_.Drop( variable_map_.mandu(i) );
+        }
+        for( std::vector<Mandu*>::iterator i = orphand_mandus_.begin() ;
+                i != orphand_mandus_.end() ; ++i ) {
+            mandu_pool_.Drop( *i );
         }
     }
-    UNREACHABLE(return -1);
-}
 
-bool Executor::Cook( const std::string& text , std::string* output , std::string* error ) {
-    static const std::size_t kDefaultSize = 4096; // 4KB
-    output->clear();
-    output->reserve( kDefaultSize );
-
-    for( std::size_t i = 0 ; i < text.size() ; ++i ) {
-        if( text[i] == '\\' ) {
-            if( i+1 < text.size() && text[i+1] == '`' ) {
-                output->push_back('`');
-                ++i;
-                continue;
-            }
-        }
-        if( text[i] == '`' ) {
-            int ret = CookSegment(text,i,output,error);
-            if( ret <0 )
-                return false;
-            i = static_cast<std::size_t>(ret);
-        } else {
-            output->push_back( text[i] );
-        }
+    Mandu* NewMandu( const std::string& section_key , const std::string& key ) {
+        assert( !frozen_ );
+        SymbolTable* symbols = SymbolTable::Instance();
+        Mandu* new_mandu = mandu_pool_.Grab();
+        Mandu* ret = variable_map_.InsertMandu( symbols->Intern(section_key) ,
+                symbols->Intern(key) , new_mandu );
+        if( ret != new_mandu )
+            mandu_pool_.Drop(ret);
+        return new_mandu;
     }
-    return true;
-}
 
-bool Executor::IsSectionEnabled( const std::string& key ) const {
-    return variable_map_.IsSectionEnabled(key);
-}
+    Mandu* NewMandu( const std::string& key ) {
+        assert( !frozen_ );
+        Mandu* new_mandu = mandu_pool_.Grab();
+        Mandu* ret = variable_map_.InsertMandu( SymbolTable::Instance()->Intern(key) , new_mandu );
+        if( ret != new_mandu )
+            mandu_pool_.Drop(ret);
+        return new_mandu;
+    }
 
-bool Executor::EnableSection( const std::string& key ) {
-    return variable_map_.SetSectionEnable(key,true);
-}
+    Mandu* NewMandu() {
+        assert( !frozen_ );
+        Mandu* mandu = mandu_pool_.Grab();
+        orphand_mandus_.push_back(mandu);
+        return mandu;
+    }
 
-bool Executor::DisableSection( const std::string& key ) {
-    return variable_map_.SetSectionEnable(key,false);
-}
+    void Freeze() {
+        frozen_ = true;
+    }
 
-void Executor::Clear() {
-    const int size = variable_map_.mandu_map_size();
+    bool frozen() const {
+        return frozen_;
+    }
 
-    for( int i = 0 ; i < size ; ++i ) {
-        mandu_pool_.Drop( variable_map_.mandu(i) );
+    const VariableMap& variable_map() const {
+        return variable_map_;
     }
 
-    variable_map_.Clear();
+private:
+    ZoneAllocator<Mandu> mandu_pool_;
+    VariableMap variable_map_;
+    std::vector<Mandu*> orphand_mandus_;
+    bool frozen_;
+};
 
-    // Clear the orphand list
-    for( std::vector<Mandu*>::iterator i = orphand_mandus_.begin() ;
-            i != orphand_mandus_.end() ; ++i ) {
-        mandu_pool_.Drop( *i );
+// ScopePublisherImpl keeps the last versions of a published scope in a ring
+// of slots. A reader pins the current slot with a counter and checks the
+// slot is still the current one , otherwise it unpins and tries again , so a
+// reader never waits for anything. A writer puts the new version into a slot
+// nobody pins and then makes it the current one. The version that was inside
+// of that slot is deleted then , nobody could reach it anymore. When every
+// older slot is pinned , eg by long lived cursors , the ring grows instead of
+// waiting. The slots are allocated in chunks which never move or go away
+// before the publisher , so a reader could always touch the slot it loaded.
+class ScopePublisherImpl {
+public:
+    // Chunk k holds kFirstChunk << k slots
+    static const int kFirstChunk = 8;
+    static const int kFirstChunkBits = 3;
+    static const int kMaxChunks = 24;
+
+    ScopePublisherImpl():
+        slot_count_(0),
+        current_(-1),
+        version_(0)
+    {
+        for( int i = 0 ; i < kMaxChunks ; ++i ) {
+            chunks_[i].store(NULL);
+        }
     }
-    orphand_mandus_.clear();
-}
 
-Mandu* Executor::NewMandu( const std::string& section_key , const std::string& key ) {
-    Mandu* new_mandu = mandu_pool_.Grab();
-    Mandu* ret = variable_map_.InsertMandu( section_key , key , new_mandu );
-    if( ret != new_mandu ) {
-        mandu_pool_.Drop(ret);
-    } 
-    return new_mandu;
-}
+    ~ScopePublisherImpl() {
+        for( int i = 0 ; i < slot_count_ ; ++i ) {
+            assert( At(i)->pin.load() == 0 );
+            delete At(i)->scope;
+        }
+        for( int i = 0 ; i < kMaxChunks ; ++i ) {
+            delete [] chunks_[i].load();
+        }
+    }
 
-Mandu* Executor::NewMandu( const std::string& key ) {
-    Mandu* new_mandu = mandu_pool_.Grab();
-    Mandu* ret = variable_map_.InsertMandu( key , new_mandu );
-    if( ret != new_mandu ) {
-        mandu_pool_.Drop(ret);
+    // Pin the current version , the slot is stored inside of slot and is -1
+    // if nothing has been published yet.
+    const ScopeImpl* Acquire( int* slot ) {
+        for( ;; ) {
+            int i = current_.load();
+            if( i < 0 ) {
+                *slot = -1;
+                return NULL;
+            }
+            Slot* s = At(i);
+            s->pin.fetch_add(1);
+            if( current_.load() == i ) {
+                *slot = i;
+                return s->impl;
+            }
+            s->pin.fetch_sub(1);
+        }
     }
-    return ret;
-}
 
-Mandu* Executor::NewMandu() {
-    Mandu* mandu = mandu_pool_.Grab();
-    orphand_mandus_.push_back( mandu );
-    return mandu;
-}
+    void Release( int slot ) {
+        if( slot >= 0 )
+            At(slot)->pin.fetch_sub(1);
+    }
 
-bool Executor::LookUpVariable( const std::string& section_name, const std::string& key , Mandu* mandu ) const {
-    if( variable_map_.IsSectionEnabled(section_name) ) {
-        Mandu* ret = variable_map_.FindMandu( section_name , key );
-        if( ret == NULL )
-            goto look_up_global_variable;
-        else {
-            mandu->Copy(*ret);
-            return true;
+    void Publish( Scope* scope , const ScopeImpl* impl ) {
+        std::lock_guard<std::mutex> guard(mutex_);
+        const int current = current_.load();
+        int slot;
+        for( slot = 0 ; slot < slot_count_ ; ++slot ) {
+            if( slot != current && At(slot)->pin.load() == 0 )
+                break;
+        }
+        if( slot == slot_count_ ) {
+            // Every older version is still pinned , add a slot
+            int index;
+            int chunk = ChunkOf( slot , &index );
+            assert( chunk < kMaxChunks );
+            if( chunks_[chunk].load() == NULL )
+                chunks_[chunk].store( new Slot[ kFirstChunk << chunk ] );
+            ++slot_count_;
         }
-    } 
 
-look_up_global_variable:
-    Mandu* ret = variable_map_.FindMandu( key );
-    if( ret == NULL )
-        return false;
-    else {
-        mandu->Copy(*mandu);
-        return true;
+        Slot* s = At(slot);
+        delete s->scope;
+        s->scope = scope;
+        s->impl = impl;
+        current_.store(slot);
+        version_.fetch_add(1);
     }
-}
-
-bool Executor::ParseNumber( Mandu* val , std::string* error ) {
-    assert( tokenizer_.cur_lexme().token == TK_NUMBER );
-    long lval;
-    char* pend;
 
-    errno = 0;
-    lval = ::strtol( string_to_array(
-                &tokenizer_.source(),tokenizer_.position()), &pend, 10);
-    if( errno != 0 ) {
-        error->assign( ::strerror( errno ) );
-        return false;
+    uint64_t version() const {
+        return version_.load();
     }
 
-    val->SetNumber( static_cast<int>(lval) );
-    // Moving the tokenizer here
-    tokenizer_.Move( pend-string_to_array(
-                &tokenizer_.source(),tokenizer_.position()));
-    return true;
-}
+private:
+    struct Slot {
+        Scope* scope;
+        const ScopeImpl* impl;
+        std::atomic<int> pin;
+
+        Slot():
+            scope(NULL),
+            impl(NULL),
+            pin(0)
+        {}
+    };
 
-bool Executor::ParseVariable( const std::string& section , Mandu* val , std::string* error ) {
-   assert( tokenizer_.cur_lexme().token == TK_VARIABLE );
+    static int ChunkOf( int slot , int* index ) {
+        unsigned int n = static_cast<unsigned int>(slot) + kFirstChunk;
+        int chunk = 31 - __builtin_clz(n) - kFirstChunkBits;
+        *index = static_cast<int>( n - ( static_cast<unsigned int>(kFirstChunk) << chunk ) );
+        return chunk;
+    }
 
-   // Get variable name from current stream
-   std::size_t i;
-   for( i = tokenizer_.position()+1 ; i < tokenizer_.source().size() ; ++i ) {
-       if( !IsRestVariableChar( tokenizer_.source().at(i) ) ) {
-           break;
-       }
-   }
-   std::string var_name = tokenizer_.source().substr(
-           tokenizer_.position(),i-tokenizer_.position());
+    Slot* At( int slot ) const {
+        int index;
+        int chunk = ChunkOf( slot , &index );
+        return chunks_[chunk].load() + index;
+    }
 
-   // Look up the variable in the context
-   if( !LookUpVariable(section,var_name,val) ) {
-       ReportError(error,"Variable:%s in section:%s is not existed!",var_name.c_str(),
-               section.empty()?"<Global>":section.c_str());
-       return false;
-   }
+    std::atomic<Slot*> chunks_[kMaxChunks];
+    // Number of slots in use , only touched by the writers
+    int slot_count_;
+    std::atomic<int> current_;
+    std::atomic<uint64_t> version_;
+    // Serialize the writers
+    std::mutex mutex_;
+};
 
-   tokenizer_.Set(i);
-   return true;
-}
+// FragmentCacheImpl keeps the output of the top level segments. A segment is
+// known by the hash of its text , and what it read the last time it was
+// evaluated is remembered with it. The output is keyed by the segment and the
+// fingerprint of the values of those reads , so a segment whose variables
+// have not changed is not evaluated again. The cache is split into shards ,
+// each with its own lock and LRU list , the memory bound is per shard.
+class FragmentCacheImpl {
+public:
+    static const std::size_t kShardSize = 16;
+    // Rough bookkeeping cost of an entry
+    static const std::size_t kEntryOverhead = 64;
 
-bool Executor::ParseString( Mandu* val , std::string* error ) {
-    assert( tokenizer_.cur_lexme().token == TK_STRING );
-    // Parse the string into the Mandu buffer
-    std::size_t i;
-    std::string output;
+    enum {
+        // Lookup of a variable , it covers the section it is looked up in
+        DEPENDENCY_VARIABLE,
+        // Whether a sentence section is enabled
+        DEPENDENCY_SECTION,
+        // Text of a partial
+        DEPENDENCY_PARTIAL
+    };
 
-    std::size_t len =0;
+    struct Dependency {
+        int kind;
+        int section;
+        int key;
+        bool operator == ( const Dependency& d ) const {
+            return kind == d.kind && section == d.section && key == d.key;
+        }
+        bool operator < ( const Dependency& d ) const {
+            if( kind != d.kind ) return kind < d.kind;
+            if( section != d.section ) return section < d.section;
+            return key < d.key;
+        }
+    };
 
-    // 1. First loop to decide the length of the string. ( This avoid the initial
-    // copy since we are not sure that a SSO string is implemented for libc++ )
-    // And typically such loop is cheaper than initial mallocation ( Suppose that
-    // you have a string which is 31 bytes long, however start with 1->2-->4-->16-->32
-    // which costs you 5 times malloc call).
+    struct Segment {
+        // Text of the segment , the hash it is found by may collide
+        std::string text;
+        std::vector<Dependency> dependencies;
+        // False once the segment used a provider or a generator
+        bool cacheable;
+    };
 
-    for( i = tokenizer_.position()+1 ; i < tokenizer_.source().size() ; ++i ) {
-        int cha = tokenizer_.source().at(i);
+    explicit FragmentCacheImpl( std::size_t max_bytes ):
+        max_shard_bytes_( max_bytes / kShardSize ),
+        hit_(0),
+        miss_(0)
+    {}
 
-        if( cha == '\\' ) {
-            if( IsStringLiteralEscapeChar(i+1) ) {
-                ++len;
-                ++i;
-            } else {
-                ++len;
-            }
-        } else {
-            if( cha == '\"' ) {
-                break;
-            } else {
-                ++len;
-            }
-        }
+    // Longest key an entry could have
+    std::size_t max_key_bytes() const {
+        return max_shard_bytes_;
     }
 
-    if( i == tokenizer_.source().size() ) {
-        ReportError(error,"The string literal is not closed by \"");
-        return false;
+    std::shared_ptr<const Segment> FindSegment( uint64_t segment ) {
+        Shard& shard = shards_[ segment % kShardSize ];
+        std::lock_guard<std::mutex> guard(shard.mutex);
+        std::unordered_map<uint64_t,std::shared_ptr<const Segment> >::iterator
+            iter = shard.segments.find(segment);
+        if( iter == shard.segments.end() )
+            return std::shared_ptr<const Segment>();
+        return iter->second;
     }
 
-    output.reserve(len);
+    void SetSegment( uint64_t segment , const std::shared_ptr<const Segment>& info ) {
+        Shard& shard = shards_[ segment % kShardSize ];
+        std::lock_guard<std::mutex> guard(shard.mutex);
+        shard.segments[segment] = info;
+    }
 
-    // 2. Copy the data into the buffer
-    for( i = tokenizer_.position()+1 ; i < tokenizer_.source().size() ; ++i ) {
-        int cha = tokenizer_.source().at(i);
+    // The output is only returned if it was stored with the same key bytes
+    std::shared_ptr<const std::string> Find( const FragmentKey& key ) {
+        const uint64_t hash = key.hash();
+        Shard& shard = shards_[ hash % kShardSize ];
+        std::lock_guard<std::mutex> guard(shard.mutex);
+        std::unordered_map<uint64_t,EntryList::iterator>::iterator
+            iter = shard.index.find(hash);
+        if( iter == shard.index.end() || iter->second->key != key.bytes() ) {
+            miss_.fetch_add(1,std::memory_order_relaxed);
+            return std::shared_ptr<const std::string>();
+        }
+        shard.lru.splice( shard.lru.begin() , shard.lru , iter->second );
+        hit_.fetch_add(1,std::memory_order_relaxed);
+        return iter->second->output;
+    }
 
-        if( cha  == '\\' ) {
-            if( IsStringLiteralEscapeChar( i+1 ) ) {
-                output.push_back( tokenizer_.source().at(i+1) );
-                i++;
-            } else {
-                output.push_back( cha );
-            }
-        } else {
-            if( tokenizer_.source().at(i) == '\"' ) {
-                break;
-            } else {
-                output.push_back(cha);
-            }
+    void Insert( const FragmentKey& key , std::string&& output ) {
+        const std::size_t bytes = output.size() + key.bytes().size() + kEntryOverhead;
+        if( bytes > max_shard_bytes_ )
+            return;
+        const uint64_t hash = key.hash();
+        Shard& shard = shards_[ hash % kShardSize ];
+        std::lock_guard<std::mutex> guard(shard.mutex);
+        std::unordered_map<uint64_t,EntryList::iterator>::iterator
+            iter = shard.index.find(hash);
+        if( iter != shard.index.end() ) {
+            if( iter->second->key == key.bytes() )
+                return;
+            // Another key with the same hash , the newer one wins
+            Erase( &shard , iter->second );
+        }
+        Entry entry = { hash , key.bytes() , std::make_shared<const std::string>(std::move(output)) };
+        shard.lru.push_front(entry);
+        shard.index[hash] = shard.lru.begin();
+        shard.bytes += bytes;
+        while( shard.bytes > max_shard_bytes_ ) {
+            Erase( &shard , --shard.lru.end() );
         }
     }
-    val->SetString(output);
-    // Move the tokenizer
-    tokenizer_.Set(i+1);
-    return true;
-}
 
-bool Executor::ParseAtomic( const std::string& section , Mandu* val , std::string* error ) {
-    switch( tokenizer_.cur_lexme().token ) {
-        case TK_NUMBER:
-            return ParseNumber(val,error);
-        case TK_STRING:
-            return ParseString(val,error);
-        case TK_VARIABLE:
-            return ParseVariable(section,val,error);
-        default:
-            UNREACHABLE(return false);
+    void Clear() {
+        for( std::size_t i = 0 ; i < kShardSize ; ++i ) {
+            std::lock_guard<std::mutex> guard(shards_[i].mutex);
+            shards_[i].segments.clear();
+            shards_[i].index.clear();
+            shards_[i].lru.clear();
+            shards_[i].bytes = 0;
+        }
     }
-}
 
-int Executor::ParseListElement( const std::string& section , Mandu* from , Mandu* to ,
-       std::vector<Mandu*>* output , std::string* error  ) {
-    // ListElement means a single element in the list, it optionally can be a range value or
-    // a single value. The single value could be an atomic value or another list
-    switch( tokenizer_.cur_lexme().token ) {
+    std::size_t size() {
+        std::size_t ret = 0;
+        for( std::size_t i = 0 ; i < kShardSize ; ++i ) {
+            std::lock_guard<std::mutex> guard(shards_[i].mutex);
+            ret += shards_[i].bytes;
+        }
+        return ret;
+    }
+
+    uint64_t hit_count() const {
+        return hit_.load();
+    }
+
+    uint64_t miss_count() const {
+        return miss_.load();
+    }
+
+private:
+    struct Entry {
+        uint64_t hash;
+        std::string key;
+        std::shared_ptr<const std::string> output;
+    };
+    typedef std::list<Entry> EntryList;
+
+    struct Shard {
+        Shard():
+            bytes(0)
+        {}
+        std::mutex mutex;
+        std::unordered_map<uint64_t,std::shared_ptr<const Segment> > segments;
+        // Most recently used first
+        EntryList lru;
+        std::unordered_map<uint64_t,EntryList::iterator> index;
+        std::size_t bytes;
+    };
+
+    static void Erase( Shard* shard , EntryList::iterator entry ) {
+        shard->bytes -= entry->output->size() + entry->key.size() + kEntryOverhead;
+        shard->index.erase(entry->hash);
+        shard->lru.erase(entry);
+    }
+
+    Shard shards_[kShardSize];
+    const std::size_t max_shard_bytes_;
+    std::atomic<uint64_t> hit_;
+    std::atomic<uint64_t> miss_;
+};
+
+// Passes the text through and keeps a copy of it
+struct TeeOutput : public Output {
+    explicit TeeOutput( Output* o ):
+        output(o)
+    {}
+
+    virtual void Append( const char* str , std::size_t length ) {
+        text.append(str,length);
+        output->Append(str,length);
+    }
+
+    virtual void AppendLiteral( const char* str , std::size_t length ) {
+        text.append(str,length);
+        output->AppendLiteral(str,length);
+    }
+
+    Output* output;
+    std::string text;
+};
+
+// Records what a top level segment reads and writes while it is evaluated
+struct FragmentRecorder : public TeeOutput {
+    explicit FragmentRecorder( Output* o ):
+        TeeOutput(o),
+        cacheable( true )
+    {}
+
+    void Record( int kind , int section , int key ) {
+        FragmentCacheImpl::Dependency d = { kind , section , key };
+        // A body reads the same variable over and over
+        if( dependencies.empty() || !(dependencies.back() == d) )
+            dependencies.push_back(d);
+    }
+
+    std::vector<FragmentCacheImpl::Dependency> dependencies;
+    bool cacheable;
+};
+
+class Executor {
+public:
+    static const std::size_t kMemoryPoolInitialSize = 64;
+    static const std::size_t kMemoryPoolMaximumSize = 512;
+
+    static const int kMaxPartialDepth = 64;
+
+    Executor():
+        mandu_pool_( kMemoryPoolInitialSize , kMemoryPoolMaximumSize ),
+        minify_whitespace_( false ),
+        minified_(),
+        dollar_( NULL ),
+        section_( VariableMap::kGlobal ),
+        partial_depth_(0),
+        stack_limit_(0),
+        aborted_(false),
+        base_( NULL ),
+        publisher_( NULL ),
+        fragment_cache_( NULL ),
+        recorder_( NULL ),
+        parallel_threads_(0),
+        parallel_min_segments_(0),
+        helpers_(),
+        workers_(),
+        worker_batch_( NULL ),
+        worker_generation_(0),
+        worker_active_(0),
+        worker_running_(0),
+        worker_stop_( false ),
+        piece_indexes_(),
+        piece_stamp_(0),
+        shared_( NULL ),
+        generator_read_( false ),
+        iterating_(),
+        reentered_( false ),
+        hoisted_(),
+        volatile_reads_(0),
+        recording_(0),
+        fields_(),
+        profiler_( NULL ),
+        size_hints_(),
+        max_output_reserve_( kDefaultMaxOutputReserve ),
+        temporaries_peak_(0)
+        {}
+
+    ~Executor() {
+        delete profiler_;
+        StopWorkers();
+        for( std::vector<Executor*>::iterator i = helpers_.begin() ; i != helpers_.end() ; ++i ) {
+            delete *i;
+        }
+        ClearPieceIndexes();
+        Clear();
+        for( std::vector<Partial*>::iterator i = partials_.begin() ; i != partials_.end() ; ++i ) {
+            delete *i;
+        }
+    }
+
+    bool RegisterPartial( const std::string& name , const std::string& text , std::string* error );
+    bool RemovePartial( const std::string& name );
+
+    void EnableProfiling( bool enable ) {
+        if( !enable ) {
+            delete profiler_;
+            profiler_ = NULL;
+        } else if( profiler_ == NULL ) {
+            profiler_ = new Profiler();
+        }
+    }
+
+    Profiler* profiler() const {
+        return profiler_;
+    }
+
+    // The base scope is consulted after the variables of this executor
+    void SetBaseScope( const ScopeImpl* base ) {
+        assert( base == NULL || base->frozen() );
+        base_ = base;
+        publisher_ = NULL;
+    }
+
+    // The base scope is the version of the publisher that is current when a
+    // cook starts
+    void SetScopePublisher( ScopePublisherImpl* publisher ) {
+        base_ = NULL;
+        publisher_ = publisher;
+    }
+
+    void SetFragmentCache( FragmentCacheImpl* cache ) {
+        fragment_cache_ = cache;
+    }
+
+    // Evaluate the top level segments of a text on threads threads once it
+    // has at least min_segments of them , 0 or 1 thread disables it
+    void SetParallelSegments( std::size_t threads , std::size_t min_segments ) {
+        // The worker threads are started again by the next parallel cook
+        StopWorkers();
+        if( threads <= 1 )
+            ClearPieceIndexes();
+        parallel_threads_ = threads;
+        parallel_min_segments_ = min_segments;
+    }
+
+    // Delegate function
+    bool IsSectionEnabled( const std::string& section_key ) const;
+    bool EnableSection( const std::string& section_key );
+    bool DisableSection( const std::string& section_key );
+
+    Mandu* NewMandu( const std::string& section_key , const std::string& key );
+    Mandu* NewMandu( const std::string& key );
+    Mandu* NewMandu();
+
+    void BindProvider( const std::string& section_key , const std::string& key ,
+            VariableProvider* provider , bool memoize );
+    void BindProvider( const std::string& key , VariableProvider* provider , bool memoize );
+
+    void FreeMandu( Mandu* mandu ) {
+        mandu_pool_.Drop(mandu);
+    }
+
+    void Clear();
+
+    // Drop the settings and the partials as well , the executor is then like
+    // a new one except for its pools and the sizes it learned
+    void Reset() {
+        Clear();
+        SetBaseScope(NULL);
+        SetFragmentCache(NULL);
+        EnableProfiling(false);
+        set_minify_whitespace(false);
+        if( parallel_threads_ != 0 )
+            SetParallelSegments(0,0);
+        SetSizingLimits( kDefaultMaxOutputReserve , kMemoryPoolMaximumSize );
+        for( std::vector<Partial*>::iterator i = partials_.begin() ; i != partials_.end() ; ++i ) {
+            delete *i;
+        }
+        partials_.clear();
+    }
+
+    // The pieces of a compiled template let the cook skip the scanning of
+    // the literal text , they are optional.
+    bool Cook( const Source& text , std::string* output , std::string* error ,
+            const TemplatePiece* pieces = NULL , std::size_t piece_count = 0 );
+    bool Cook( const Source& text , ScatterOutput* output , std::string* error ,
+            const TemplatePiece* pieces = NULL , std::size_t piece_count = 0 );
+    bool Cook( const Source& text , Output* output , std::string* error ,
+            const TemplatePiece* pieces = NULL , std::size_t piece_count = 0 );
+    bool DoCook( const Source& text , Output* output , std::string* error ,
+            const TemplatePiece* pieces , std::size_t piece_count );
+
+    // Limits of the sizes learned from the history of the templates
+    void SetSizingLimits( std::size_t max_output_reserve , std::size_t max_pool_page ) {
+        max_output_reserve_ = max_output_reserve;
+        mandu_pool_.set_max_capacity( max_pool_page );
+    }
+
+    void set_stack_limit( uintptr_t limit ) {
+        stack_limit_ = limit;
+    }
+
+    // An aborted cook fails at the next check , so the stack of a dropped
+    // cursor unwinds without evaluating the rest of the page
+    void set_aborted( bool aborted ) {
+        aborted_ = aborted;
+    }
+
+    // Fail the cook instead of running off the stack of a cursor , or once
+    // the cook is aborted
+    bool CheckStack( std::string* error );
+
+    void set_minify_whitespace( bool minify ) {
+        minify_whitespace_ = minify;
+        if( !minify )
+            std::string().swap(minified_);
+    }
+
+    bool minify_whitespace() const {
+        return minify_whitespace_;
+    }
+
+    // Get the text that is really cooked. With whitespace minification it is
+    // the minified copy of the text , which lives until the next Prepare.
+    Source Prepare( const Source& text );
+
+private:
+    bool CookSegment( const Source& text , std::size_t position , std::size_t* end ,
+            Output* output , std::string* error );
+
+    // Cook a top level segment through the fragment cache , the length of the
+    // segment is 0 if it is not known yet
+    bool CookTopSegment( const Source& text , std::size_t position , std::size_t length ,
+            std::size_t* end , Output* output , std::string* error );
+
+    // Key of the output of a segment , its text and the current values of
+    // what it read. False if one of them could not be fingerprinted , eg a
+    // provider or a generator , or the key is too long to be cached
+    bool FingerprintDependencies( const std::string& segment ,
+            const std::vector<FragmentCacheImpl::Dependency>& dependencies , FragmentKey* key );
+    bool FingerprintValue( const Mandu& value , FragmentKey* fingerprint );
+
+    // The top level segments of one parallel cook , each one is cooked into
+    // its own buffer by whichever helper takes it first
+    struct SegmentBatch {
+        const Source* text;
+        std::vector<const TemplatePiece*> segments;
+        std::vector<std::string> outputs;
+        std::atomic<std::size_t> next;
+        // Set once a helper meets a generator
+        std::atomic<bool> sequential;
+        // Lowest failed segment and its error , guarded by mutex
+        std::size_t failed;
+        std::string error;
+        std::mutex mutex;
+    };
+
+    // A segment nested inside of a body that doesn't see the $ of the body
+    // writes the same text in every iteration. It is cooked once per cook and
+    // replayed , unless it calls a provider or a generator that may return
+    // something else each time.
+    struct HoistedSegment {
+        enum {
+            HOIST_UNKNOWN,
+            HOIST_REPLAY,
+            HOIST_NEVER
+        };
+        const char* at;
+        int section;
+        int state;
+        // Position of the ending backtick
+        std::size_t end;
+        std::string text;
+        // The fragment recording the text was captured in , a recording
+        // that doesn't have the reads of the segment cooks it again
+        std::size_t recording;
+        bool operator < ( const std::pair<const char*,int>& key ) const {
+            return at < key.first || (at == key.first && section < key.second);
+        }
+    };
+
+    bool CookNestedSegment( const Source& source , std::size_t position , std::size_t* end ,
+            Output* output , std::string* error );
+    HoistedSegment* FindHoistedSegment( const char* at , int section );
+
+    // sequential is set if the text must be cooked sequentially instead , the
+    // output is untouched then
+    bool ParallelCook( const Source& text , Output* output , std::string* error ,
+            const TemplatePiece* pieces , std::size_t piece_count , bool* sequential );
+    void CookSegments( Executor* helper , SegmentBatch* batch );
+    // Body of the index-th worker thread , it cooks with helpers_[index] the
+    // batches published after generation
+    void RunWorker( std::size_t index , std::size_t generation );
+    void StopWorkers();
+
+    // The pieces of a text that is not a Template , NULL if it is broken
+    const std::vector<TemplatePiece>* FindPieceIndex( const Source& text );
+    void ClearPieceIndexes();
+
+    void ReportError( std::string* error , const char* format , ... );
+
+    bool ParseString( Mandu* output , std::string* error );
+    bool ParseNumber( Mandu* number , std::string* error );
+    bool ParseVariable( int section , const Mandu** var , std::string* error );
+    // Slice of a list , eg Rows[100:200] , val is the list and becomes the view
+    bool IsSlice( std::size_t position ) const;
+    bool ParseSlice( int section , const Mandu** val , std::string* error );
+    bool ParseAtomic( int section , const Mandu** val , std::string* error );
+
+    enum {
+        ELEMENT_RANGE,
+        ELEMENT_ATOMIC,
+        ELEMENT_LIST,
+        ELEMENT_FAIL
+    };
+
+    // This function will parse the list element in different format.
+    // The return value can be used to decide which type of list elements has been
+    // processed. Additionally, for element that is a list, the outputs array will
+    // be pushed on top of it.
+    int ParseListElement( int section , const Mandu** from ,
+            const Mandu** to , std::vector<const Mandu*>* outputs , std::string* error );
+
+    bool ParseList( int section , std::vector<const Mandu*>* outputs, std::string* error );
+
+    // Parse the optional filter of a sentence , eg Var|html
+    bool ParseFilter( int* filter , std::string* error );
+
+    bool ExecuteList( int section , Output* output , std::string* error );
+    bool ExecuteListBody( const Source& source, std::size_t position , std::size_t* offset ,
+            const Mandu* const* begin , const Mandu* const* end , int filter ,
+            Output* output , std::string* error );
+    bool ExecuteGeneratorBody( const Source& source, std::size_t position , std::size_t* offset ,
+            ListGenerator* generator , int filter , Output* output , std::string* error );
+    bool ExecuteAtomic( int section , Output* output , std::string* error );
+    bool ExecuteBody( const Dollar& dollar_value , const Source& source, std::size_t position ,
+            std::size_t* offset , Output* output , std::string* error );
+    bool ExecutePartial( int section , Output* output , std::string* error );
+    bool Execute( Output* output , std::string* error );
+
+    // Resolve $.name of a record , position is the "." and last is set to the
+    // last character of the name
+    bool LookUpField( const Dollar& dollar_sign , const Source& source , std::size_t position ,
+            std::size_t* last , const Mandu** field , std::string* error );
+
+    // Executes all the template sentences inside of a code segment , the
+    // result is written into the output directly.
+    bool DoExecute( Output* output , std::string* error );
+
+    // Write the value into the output. A list is written element by element
+    // so it never needs to be joined into a string first.
+    void AppendValue( const Mandu& value , Output* output );
+    void AppendDollar( const Dollar& dollar , Output* output );
+
+    // Look up the variable and return its value slot , -1 if not existed.
+    // The section and the variable are symbols.
+    int LookUpVariable( int section , int variable ) const;
+
+    // Get the value of the slot, calling its provider if it has one
+    bool ResolveVariable( int slot , const Mandu** output );
+
+    // A slot of the base scope is marked with this bit
+    static const int kBaseSlot = 1<<30;
+
+    // Whether the section is enabled , the state set on this executor hides
+    // the one of the base scope
+    bool IsSectionEnabled( int section ) const;
+    bool SetSectionEnable( int section , bool value );
+
+    // Name of the section for the error message
+    static const char* SectionName( int section ) {
+        return section == VariableMap::kGlobal ? "<Global>" :
+            SymbolTable::Instance()->Name(section).c_str();
+    }
+
+    // Forget all the memoized values of the last cook
+    void ResetMemoized();
+
+    // Temporary mandus are the values created while executing a sentence, for
+    // example literals and range elements. They are dropped in stack order ,
+    // each sentence drops the ones created after its mark when it is done.
+    template< typename... Args >
+    Mandu* NewTemporary( Args&&... args ) {
+        Mandu* m = mandu_pool_.Grab( std::forward<Args>(args)... );
+        temporaries_.push_back(m);
+        if( temporaries_.size() > temporaries_peak_ )
+            temporaries_peak_ = temporaries_.size();
+        if( profiler_ != NULL )
+            profiler_->CountAllocation();
+        return m;
+    }
+
+    void DropTemporary( std::size_t mark ) {
+        for( std::size_t i = mark ; i < temporaries_.size() ; ++i ) {
+            mandu_pool_.Drop( temporaries_[i] );
+        }
+        temporaries_.resize(mark);
+    }
+
+private:
+    // The body may be a partial , not the text of the tokenizer
+    bool IsBodyEscapeChar( const Source& source , std::size_t position ) {
+        if( position < source.size() ) {
+            return IsExecutorBodyEscapeChar( source.at(position) );
+        } else {
+            return false;
+        }
+    }
+
+    bool IsStringLiteralEscapeChar( std::size_t position ) {
+        if( position < tokenizer_.source().size() ) {
+            return IsExecutorStringLiteralEscapeChar( tokenizer_.source().at(position) );
+        } else {
+            return false;
+        }
+    }
+
+private:
+    // Internally manage all the mandu memory allocation
+    ZoneAllocator<Mandu> mandu_pool_;
+
+    // Map for holding the variables
+    VariableMap variable_map_;
+
+    // For those mandu that _doesn't_ have any related key or section, we just put it
+    // into the orphand list. To record these mandus are useful,since we need to clear
+    // those mandus once we are done
+    std::vector<Mandu*> orphand_mandus_;
+
+    // Temporary mandus of the sentences under execution
+    std::vector<Mandu*> temporaries_;
+
+    // Slots that are memoized during the current cook
+    std::vector<int> memoized_;
+
+    // Tokenizer for this executor
+    Tokenizer tokenizer_;
+
+    // Whitespace minification of the cooked text. Checking whether a text
+    // was minified before costs as much as minifying it , so the buffer is
+    // just reused. A Template is minified once instead.
+    bool minify_whitespace_;
+    std::string minified_;
+
+    // A partial is kept as the text of a body with the ending "}" , it is
+    // checked once when it is registered. Sorted by name.
+    struct Partial {
+        std::string name;
+        std::string text;
+        bool operator < ( const std::string& n ) const {
+            return name < n;
+        }
+    };
+    struct PartialLess {
+        bool operator () ( const Partial* partial , const std::string& name ) const {
+            return *partial < name;
+        }
+    };
+    std::vector<Partial*> partials_;
+
+    // A helper uses the partials of the executor it helps
+    const std::vector<Partial*>& partials() const {
+        return shared_ != NULL ? shared_->partials_ : partials_;
+    }
+
+    // The $ of the innermost body under execution , NULL at the top level
+    const Dollar* dollar_;
+    // Section of the partial under execution , it is the default section of
+    // the segments inside of the partial
+    int section_;
+    int partial_depth_;
+    // Lowest address the evaluation may reach on the stack of a cursor , 0
+    // when running on the stack of the thread
+    uintptr_t stack_limit_;
+    bool aborted_;
+
+    // Frozen variables shared with other executors , may be NULL
+    const ScopeImpl* base_;
+    ScopePublisherImpl* publisher_;
+
+    // NULL unless a fragment cache is attached , the recorder is set while a
+    // top level segment is evaluated for the cache
+    FragmentCacheImpl* fragment_cache_;
+    FragmentRecorder* recorder_;
+
+    std::size_t parallel_threads_;
+    std::size_t parallel_min_segments_;
+    std::vector<Executor*> helpers_;
+    // Worker threads parked between the parallel cooks , workers_[i] cooks
+    // with helpers_[i+1] and helpers_[0] is used by the cooking thread. A new
+    // batch bumps worker_generation_ and the workers of the first
+    // worker_active_ helpers take part , worker_running_ counts the ones that
+    // are not done yet. All of them are guarded by worker_mutex_.
+    std::vector<std::thread> workers_;
+    std::mutex worker_mutex_;
+    std::condition_variable worker_wake_;
+    std::condition_variable worker_done_;
+    SegmentBatch* worker_batch_;
+    std::size_t worker_generation_;
+    std::size_t worker_active_;
+    std::size_t worker_running_;
+    bool worker_stop_;
+
+    // The pieces of the recent texts cooked in parallel , a text is found by
+    // its address and checked against a copy of it
+    struct PieceIndex {
+        const char* data;
+        std::string text;
+        std::vector<TemplatePiece> pieces;
+        std::size_t stamp;
+    };
+    static const std::size_t kMaxPieceIndexes = 8;
+    std::vector<PieceIndex*> piece_indexes_;
+    std::size_t piece_stamp_;
+
+    // The executor a helper works for , NULL otherwise. The helpers only read
+    // its variables , a provider is called on it under provider_mutex_.
+    Executor* shared_;
+    std::mutex provider_mutex_;
+    // Set when a helper is about to read a generator , which may be read by
+    // another segment at the same time
+    bool generator_read_;
+
+    // The generators whose body is executing , innermost last. Rewinding one
+    // of them would cut its loop short.
+    std::vector<const ListGenerator*> iterating_;
+    // Set when a value written out refers to a generator of iterating_
+    bool reentered_;
+
+    // The nested segments seen by this cook , sorted by position and section
+    std::vector<HoistedSegment> hoisted_;
+    // Bumped by each call of a provider that is not memoized and each
+    // iteration of a generator
+    std::size_t volatile_reads_;
+    // Bumped each time a top level segment starts recording its reads
+    std::size_t recording_;
+
+    // Position of a field for a $.name of the text and a layout , sorted by
+    // the place of the name and the layout
+    struct FieldSlot {
+        const char* at;
+        const RecordLayout* layout;
+        int index;
+        bool operator < ( const std::pair<const char*,const RecordLayout*>& key ) const {
+            return at < key.first || (at == key.first && layout < key.second);
+        }
+    };
+    std::vector<FieldSlot> fields_;
+
+    // NULL unless profiling is enabled
+    Profiler* profiler_;
+
+    // What each template needed when it was cooked , the output size and the
+    // peak of the temporaries. A value follows a larger use at once and
+    // decays slowly after a smaller one.
+    struct SizeHint {
+        uint64_t key;
+        std::size_t output;
+        std::size_t temporaries;
+        bool operator < ( uint64_t k ) const {
+            return key < k;
+        }
+    };
+    static const std::size_t kMaxSizeHints = 1024;
+    static const std::size_t kDefaultMaxOutputReserve = 16*1024*1024;
+
+    SizeHint* FindSizeHint( uint64_t key );
+
+    static std::size_t Adapt( std::size_t hint , std::size_t used ) {
+        std::size_t decayed = hint - hint/8;
+        return used > decayed ? used : decayed;
+    }
+
+    std::vector<SizeHint> size_hints_;
+    std::size_t max_output_reserve_;
+    std::size_t temporaries_peak_;
+};
+
+
+void Executor::ReportError( std::string* error, const char* format , ... ) {
+    std::size_t line,ccount;
+    char msg[1024];
+    va_list vl;
+    std::stringstream formatter;
+
+    va_start(vl,format);
+    tokenizer_.GetLocation(&line,&ccount);
+
+    vsnprintf(msg,sizeof(msg),format,vl);
+    va_end(vl);
+    formatter<<"[Error("<<line<<","<<ccount<<"]:"
+        <<msg<<std::endl;
+    error->assign( formatter.str() );
+}
+
+bool Executor::CookSegment( const Source& text, std::size_t position , std::size_t* end ,
+        Output* output, std::string* error ) {
+    assert( text.at(position) == '`' );
+    if( !CheckStack(error) )
+        return false;
+    ProfileScope scope(profiler_,Profiler::FRAME_SEGMENT,position,text,position);
+    tokenizer_.Bind(text,position+1);
+    if( !DoExecute(output,error) ) {
+        return false;
+    } else {
+        if( tokenizer_.cur_lexme().token != TK_END ) {
+            ReportError(error,"Expect \"`\" to end the code body");
+            return false;
+        } else {
+            *end = tokenizer_.position();
+            return true;
+        }
+    }
+    UNREACHABLE(return false);
+}
+
+bool Executor::CookTopSegment( const Source& text , std::size_t position , std::size_t length ,
+        std::size_t* end , Output* output , std::string* error ) {
+    if( fragment_cache_ == NULL )
+        return CookSegment(text,position,end,output,error);
+
+    // The segment is known by its text , an unterminated one is left to
+    // CookSegment to report
+    if( length == 0 ) {
+        std::size_t last;
+        if( !SkipSegment(text,position+1,&last) )
+            return CookSegment(text,position,end,output,error);
+        length = last - position + 1;
+    }
+    Fingerprint identity;
+    identity.Mix( text.data() + position , length );
+    const uint64_t segment = identity.hash();
+
+    std::shared_ptr<const FragmentCacheImpl::Segment> info = fragment_cache_->FindSegment(segment);
+    if( info && ( info->text.size() != length ||
+                  memcmp( info->text.data() , text.data() + position , length ) != 0 ) ) {
+        // Another segment with the same hash , its reads mean nothing here
+        info.reset();
+    }
+    if( info ) {
+        if( !info->cacheable )
+            return CookSegment(text,position,end,output,error);
+        FragmentKey key( fragment_cache_->max_key_bytes() );
+        if( FingerprintDependencies(info->text,info->dependencies,&key) ) {
+            std::shared_ptr<const std::string> fragment = fragment_cache_->Find(key);
+            if( fragment ) {
+                output->Append( fragment->data() , fragment->size() );
+                *end = position + length - 1;
+                return true;
+            }
+        }
+    }
+
+    // Evaluate it and record what it reads , the reads may differ from the
+    // last time since the sections or the values changed
+    FragmentRecorder recorder(output);
+    recorder_ = &recorder;
+    ++recording_;
+    bool ret = CookSegment(text,position,end,&recorder,error);
+    recorder_ = NULL;
+    if( !ret )
+        return false;
+
+    std::shared_ptr<FragmentCacheImpl::Segment> updated = std::make_shared<FragmentCacheImpl::Segment>();
+    updated->text.assign( text.data() + position , length );
+    std::sort( recorder.dependencies.begin() , recorder.dependencies.end() );
+    recorder.dependencies.erase( std::unique( recorder.dependencies.begin() ,
+                recorder.dependencies.end() ) , recorder.dependencies.end() );
+    updated->dependencies.swap( recorder.dependencies );
+    FragmentKey key( fragment_cache_->max_key_bytes() );
+    updated->cacheable = recorder.cacheable &&
+        FingerprintDependencies(updated->text,updated->dependencies,&key);
+    fragment_cache_->SetSegment( segment , updated );
+    if( updated->cacheable )
+        fragment_cache_->Insert( key , std::move(recorder.text) );
+    return true;
+}
+
+bool Executor::ParallelCook( const Source& text , Output* output , std::string* error ,
+        const TemplatePiece* pieces , std::size_t piece_count , bool* sequential ) {
+    SegmentBatch batch;
+    batch.text = &text;
+    for( std::size_t i = 0 ; i < piece_count ; ++i ) {
+        if( pieces[i].kind == TemplatePiece::PIECE_SEGMENT )
+            batch.segments.push_back( pieces + i );
+    }
+    batch.outputs.resize( batch.segments.size() );
+    batch.next.store(0);
+    batch.sequential.store(false);
+    batch.failed = batch.segments.size();
+
+    const std::size_t threads = std::min( parallel_threads_ , batch.segments.size() );
+    {
+        // The workers are parked , they only look at helpers_ once woken up
+        std::lock_guard<std::mutex> guard(worker_mutex_);
+        while( helpers_.size() < threads ) {
+            Executor* helper = new Executor();
+            helper->shared_ = this;
+            helpers_.push_back(helper);
+        }
+    }
+    while( workers_.size() + 1 < threads )
+        workers_.push_back( std::thread( &Executor::RunWorker , this , workers_.size() + 1 ,
+                    worker_generation_ ) );
+
+    // The temporaries made by the providers belong to this executor , they
+    // are dropped once every segment is done
+    const std::size_t mark = temporaries_.size();
+    for( std::size_t i = 0 ; i < threads ; ++i ) {
+        helpers_[i]->hoisted_.clear();
+        helpers_[i]->fields_.clear();
+        helpers_[i]->fragment_cache_ = fragment_cache_;
+    }
+    // The first helper runs on the stack of this thread
+    helpers_[0]->stack_limit_ = stack_limit_;
+    helpers_[0]->aborted_ = aborted_;
+    {
+        std::lock_guard<std::mutex> guard(worker_mutex_);
+        worker_batch_ = &batch;
+        worker_active_ = threads;
+        worker_running_ = threads - 1;
+        ++worker_generation_;
+    }
+    worker_wake_.notify_all();
+    CookSegments( helpers_[0] , &batch );
+    {
+        std::unique_lock<std::mutex> lock(worker_mutex_);
+        while( worker_running_ != 0 )
+            worker_done_.wait(lock);
+        worker_batch_ = NULL;
+    }
+    DropTemporary(mark);
+
+    *sequential = batch.sequential.load();
+    if( *sequential )
+        return false;
+
+    // Put the pieces together in order , up to the failed segment
+    std::size_t segment = 0;
+    for( std::size_t i = 0 ; i < piece_count ; ++i ) {
+        const TemplatePiece& piece = pieces[i];
+        if( piece.kind == TemplatePiece::PIECE_LITERAL ) {
+            output->AppendLiteral( text.data() + piece.offset ,
+                    static_cast<std::size_t>(piece.length) );
+            continue;
+        }
+        output->AppendString( batch.outputs[segment] );
+        if( segment == batch.failed ) {
+            error->swap( batch.error );
+            return false;
+        }
+        ++segment;
+    }
+    return true;
+}
+
+void Executor::RunWorker( std::size_t index , std::size_t generation ) {
+    // A worker started again after StopWorkers must not take the last batch
+    std::unique_lock<std::mutex> lock(worker_mutex_);
+    for( ;; ) {
+        while( !worker_stop_ && worker_generation_ == generation )
+            worker_wake_.wait(lock);
+        if( worker_stop_ )
+            return;
+        generation = worker_generation_;
+        if( index >= worker_active_ )
+            continue;
+        SegmentBatch* batch = worker_batch_;
+        Executor* helper = helpers_[index];
+        lock.unlock();
+        CookSegments( helper , batch );
+        lock.lock();
+        if( --worker_running_ == 0 )
+            worker_done_.notify_one();
+    }
+}
+
+void Executor::StopWorkers() {
+    {
+        std::lock_guard<std::mutex> guard(worker_mutex_);
+        worker_stop_ = true;
+    }
+    worker_wake_.notify_all();
+    for( std::size_t i = 0 ; i < workers_.size() ; ++i )
+        workers_[i].join();
+    workers_.clear();
+    worker_stop_ = false;
+}
+
+const std::vector<TemplatePiece>* Executor::FindPieceIndex( const Source& text ) {
+    for( std::size_t i = 0 ; i < piece_indexes_.size() ; ++i ) {
+        PieceIndex* index = piece_indexes_[i];
+        if( index->data == text.data() && index->text.size() == text.size() &&
+            memcmp( index->text.data() , text.data() , text.size() ) == 0 ) {
+            index->stamp = ++piece_stamp_;
+            return &index->pieces;
+        }
+    }
+
+    std::vector<TemplatePiece> pieces;
+    std::string ignored;
+    if( !BuildPieces(text,&pieces,&ignored) )
+        return NULL;
+
+    // Drop the least recently cooked index to make room
+    if( piece_indexes_.size() == kMaxPieceIndexes ) {
+        std::vector<PieceIndex*>::iterator oldest = piece_indexes_.begin();
+        for( std::vector<PieceIndex*>::iterator i = piece_indexes_.begin() ; i != piece_indexes_.end() ; ++i ) {
+            if( (*i)->stamp < (*oldest)->stamp )
+                oldest = i;
+        }
+        delete *oldest;
+        piece_indexes_.erase(oldest);
+    }
+    PieceIndex* index = new PieceIndex();
+    index->data = text.data();
+    index->text.assign( text.data() , text.size() );
+    index->pieces.swap(pieces);
+    index->stamp = ++piece_stamp_;
+    piece_indexes_.push_back(index);
+    return &index->pieces;
+}
+
+void Executor::ClearPieceIndexes() {
+    for( std::vector<PieceIndex*>::iterator i = piece_indexes_.begin() ; i != piece_indexes_.end() ; ++i ) {
+        delete *i;
+    }
+    piece_indexes_.clear();
+}
+
+void Executor::CookSegments( Executor* helper , SegmentBatch* batch ) {
+    for( ;; ) {
+        const std::size_t i = batch->next.fetch_add(1);
+        if( i >= batch->segments.size() || batch->sequential.load() )
+            return;
+        {
+            // Nothing after a failed segment is written out
+            std::lock_guard<std::mutex> guard(batch->mutex);
+            if( i > batch->failed )
+                return;
+        }
+        const TemplatePiece* piece = batch->segments[i];
+        StringOutput output( &batch->outputs[i] );
+        std::string error;
+        std::size_t end;
+        helper->generator_read_ = false;
+        if( !helper->CookTopSegment( *batch->text , static_cast<std::size_t>(piece->offset) ,
+                    static_cast<std::size_t>(piece->length) , &end , &output , &error ) ||
+            helper->generator_read_ ) {
+            if( helper->generator_read_ ) {
+                batch->sequential.store(true);
+                helper->DropTemporary(0);
+                return;
+            }
+            std::lock_guard<std::mutex> guard(batch->mutex);
+            if( i < batch->failed ) {
+                batch->failed = i;
+                batch->error.swap(error);
+            }
+        }
+        helper->DropTemporary(0);
+    }
+}
+
+bool Executor::FingerprintDependencies( const std::string& segment ,
+        const std::vector<FragmentCacheImpl::Dependency>& dependencies , FragmentKey* key ) {
+    FragmentKey& fingerprint = *key;
+    fingerprint.Mix( static_cast<uint64_t>(segment.size()) );
+    fingerprint.Mix( segment.data() , segment.size() );
+    for( std::size_t i = 0 ; i < dependencies.size() ; ++i ) {
+        const FragmentCacheImpl::Dependency& d = dependencies[i];
+        fingerprint.Mix( static_cast<uint64_t>(d.kind) );
+        fingerprint.Mix( static_cast<uint64_t>(static_cast<uint32_t>(d.section)) << 32 |
+                static_cast<uint32_t>(d.key) );
+        switch( d.kind ) {
+            case FragmentCacheImpl::DEPENDENCY_VARIABLE: {
+                int slot = LookUpVariable( d.section , d.key );
+                fingerprint.Mix( static_cast<uint64_t>(slot < 0 ? 0 : 1) );
+                if( slot < 0 )
+                    break;
+                VariableMap& variables = shared_ != NULL ? shared_->variable_map_ : variable_map_;
+                if( !(slot & kBaseSlot) && variables.value(slot).provider != NULL )
+                    return false;
+                const Mandu* value;
+                ResolveVariable( slot , &value );
+                if( !FingerprintValue( *value , &fingerprint ) )
+                    return false;
+                break;
+            }
+            case FragmentCacheImpl::DEPENDENCY_SECTION:
+                fingerprint.Mix( static_cast<uint64_t>(IsSectionEnabled(d.section)) );
+                break;
+            case FragmentCacheImpl::DEPENDENCY_PARTIAL: {
+                const std::string& name = SymbolTable::Instance()->Name(d.key);
+                std::vector<Partial*>::const_iterator iter = std::lower_bound(
+                        partials().begin() , partials().end() , name , PartialLess() );
+                if( iter == partials().end() || (*iter)->name != name ) {
+                    fingerprint.Mix( static_cast<uint64_t>(0) );
+                } else {
+                    fingerprint.Mix( static_cast<uint64_t>(1) );
+                    fingerprint.Mix( static_cast<uint64_t>((*iter)->text.size()) );
+                    fingerprint.Mix( (*iter)->text.data() , (*iter)->text.size() );
+                }
+                break;
+            }
+            default:
+                UNREACHABLE(return false);
+        }
+        if( key->overflow() )
+            return false;
+    }
+    return !key->overflow();
+}
+
+bool Executor::FingerprintValue( const Mandu& value , FragmentKey* fingerprint ) {
+    fingerprint->Mix( static_cast<uint64_t>(value.type()) );
+    switch( value.type() ) {
+        case Mandu::TYPE_NONE:
+            return true;
+        case Mandu::TYPE_STRING:
+            fingerprint->Mix( static_cast<uint64_t>(value.ToString().size()) );
+            fingerprint->Mix( value.ToString().data() , value.ToString().size() );
+            return true;
+        case Mandu::TYPE_NUMBER:
+            fingerprint->Mix( static_cast<uint64_t>(value.ToNumber()) );
+            return true;
+        case Mandu::TYPE_LIST: {
+            const std::vector<Mandu*>& list = value.ToList();
+            fingerprint->Mix( static_cast<uint64_t>(list.size()) );
+            for( std::size_t i = 0 ; i < list.size() ; ++i ) {
+                if( !FingerprintValue( *list[i] , fingerprint ) )
+                    return false;
+            }
+            return true;
+        }
+        case Mandu::TYPE_LIST_VIEW: {
+            Mandu* const* list = value.ToListView();
+            fingerprint->Mix( static_cast<uint64_t>(value.ColumnSize()) );
+            for( std::size_t i = 0 ; i < value.ColumnSize() ; ++i ) {
+                if( !FingerprintValue( *list[i] , fingerprint ) )
+                    return false;
+            }
+            return true;
+        }
+        case Mandu::TYPE_RECORD: {
+            // The field names decide what $.name reads
+            const std::vector<Mandu*>& fields = value.ToRecordFields();
+            const RecordLayout* layout = value.ToRecordLayout();
+            fingerprint->Mix( static_cast<uint64_t>(layout->field_size()) );
+            for( std::size_t i = 0 ; i < layout->field_size() ; ++i ) {
+                fingerprint->Mix( static_cast<uint64_t>(layout->field_name(i).size()) );
+                fingerprint->Mix( layout->field_name(i).data() , layout->field_name(i).size() );
+            }
+            for( std::size_t i = 0 ; i < fields.size() ; ++i ) {
+                if( !FingerprintValue( *fields[i] , fingerprint ) )
+                    return false;
+            }
+            return true;
+        }
+        case Mandu::TYPE_INT_ARRAY:
+            fingerprint->Mix( static_cast<uint64_t>(value.ColumnSize()) );
+            fingerprint->Mix( reinterpret_cast<const char*>(value.ToIntArray()) ,
+                    value.ColumnSize() * sizeof(int64_t) );
+            return true;
+        case Mandu::TYPE_STRING_COLUMN:
+            fingerprint->Mix( static_cast<uint64_t>(value.ColumnSize()) );
+            for( std::size_t i = 0 ; i < value.ColumnSize() ; ++i ) {
+                std::size_t length;
+                const char* str = value.ColumnString(i,&length);
+                fingerprint->Mix( static_cast<uint64_t>(length) );
+                fingerprint->Mix( str , length );
+            }
+            return true;
+        default:
+            // A generator is consumed by the reading
+            return false;
+    }
+}
+
+bool Executor::Cook( const Source& text , std::string* output , std::string* error ,
+        const TemplatePiece* pieces , std::size_t piece_count ) {
+    static const std::size_t kDefaultSize = 4096; // 4KB
+    output->clear();
+
+    // Reserve what the template has written before with a little slack ,
+    // so a steady page never grows the string
+    const SizeHint* hint = FindSizeHint( TemplateKey(text) );
+    std::size_t reserve = hint->output + hint->output/8;
+    if( reserve < kDefaultSize )
+        reserve = kDefaultSize;
+    if( reserve > max_output_reserve_ )
+        reserve = max_output_reserve_;
+    output->reserve( reserve );
+
+    StringOutput string_output(output);
+    if( !Cook(text,&string_output,error,pieces,piece_count) )
+        return false;
+    SizeHint* updated = FindSizeHint( TemplateKey(text) );
+    updated->output = Adapt( updated->output , output->size() );
+    return true;
+}
+
+Source Executor::Prepare( const Source& text ) {
+    if( !minify_whitespace_ )
+        return text;
+    minified_.clear();
+    MinifyWhitespace( text , &minified_ );
+    return Source( minified_ );
+}
+
+bool Executor::Cook( const Source& text , ScatterOutput* output , std::string* error ,
+        const TemplatePiece* pieces , std::size_t piece_count ) {
+    output->Clear();
+    ScatterSink sink(output);
+    return Cook(text,&sink,error,pieces,piece_count);
+}
+
+bool Executor::Cook( const Source& text , Output* output , std::string* error ,
+        const TemplatePiece* pieces , std::size_t piece_count ) {
+    // Take a snapshot of the published scope , it is used to the end of the
+    // cook even if a newer version is published meanwhile
+    int pin = -1;
+    if( publisher_ != NULL )
+        base_ = publisher_->Acquire(&pin);
+
+    // Have the pool ready for the temporaries this template needed before
+    SizeHint* hint = FindSizeHint( TemplateKey(text) );
+    mandu_pool_.Reserve( hint->temporaries );
+    temporaries_peak_ = temporaries_.size();
+    const std::size_t base = temporaries_.size();
+    bool ret;
+
+    if( profiler_ != NULL ) {
+        ProfileOutput counter(output,profiler_);
+        ProfileScope scope(profiler_,Profiler::FRAME_COOK,TemplateKey(text),text,0);
+        ret = DoCook(text,&counter,error,pieces,piece_count);
+    } else {
+        ret = DoCook(text,output,error,pieces,piece_count);
+    }
+
+    // The hint may be moved by a nested cook , so it is found again
+    if( ret ) {
+        hint = FindSizeHint( TemplateKey(text) );
+        hint->temporaries = Adapt( hint->temporaries , temporaries_peak_ - base );
+    }
+
+    if( publisher_ != NULL ) {
+        base_ = NULL;
+        publisher_->Release(pin);
+    }
+    return ret;
+}
+
+Executor::SizeHint* Executor::FindSizeHint( uint64_t key ) {
+    std::vector<SizeHint>::iterator iter = std::lower_bound(
+            size_hints_.begin() , size_hints_.end() , key );
+    if( iter != size_hints_.end() && iter->key == key )
+        return &*iter;
+
+    // Too many templates , just start over
+    if( size_hints_.size() == kMaxSizeHints ) {
+        size_hints_.clear();
+        iter = size_hints_.begin();
+    }
+    SizeHint hint = { key , 0 , 0 };
+    return &*size_hints_.insert( iter , hint );
+}
+
+bool Executor::DoCook( const Source& text , Output* output , std::string* error ,
+        const TemplatePiece* pieces , std::size_t piece_count ) {
+    ResetMemoized();
+    hoisted_.clear();
+    fields_.clear();
+
+    // A cursor must not build the whole page up front , so it always cooks
+    // sequentially ( it is the only one limiting the stack )
+    if( parallel_threads_ > 1 && stack_limit_ == 0 ) {
+        // A broken text is left to the sequential cook to report
+        const TemplatePiece* split = pieces;
+        std::size_t split_count = piece_count;
+        if( split == NULL ) {
+            const std::vector<TemplatePiece>* built = FindPieceIndex(text);
+            if( built != NULL && !built->empty() ) {
+                split = &(*built)[0];
+                split_count = built->size();
+            }
+        }
+        std::size_t segment_count = 0;
+        for( std::size_t i = 0 ; split != NULL && i < split_count ; ++i ) {
+            if( split[i].kind == TemplatePiece::PIECE_SEGMENT )
+                ++segment_count;
+        }
+        if( segment_count > 1 && segment_count >= parallel_min_segments_ ) {
+            // A generator may not be read by two segments at the same time ,
+            // the cook starts over sequentially once one is met
+            bool sequential = false;
+            const bool ret = ParallelCook(text,output,error,split,split_count,&sequential);
+            if( !sequential )
+                return ret;
+        }
+    }
+
+    if( pieces != NULL ) {
+        for( std::size_t i = 0 ; i < piece_count ; ++i ) {
+            const TemplatePiece& piece = pieces[i];
+            if( piece.kind == TemplatePiece::PIECE_LITERAL ) {
+                output->AppendLiteral( text.data() + piece.offset ,
+                        static_cast<std::size_t>(piece.length) );
+            } else {
+                std::size_t end;
+                if( !CookTopSegment(text,static_cast<std::size_t>(piece.offset),
+                            static_cast<std::size_t>(piece.length),&end,output,error) )
+                    return false;
+            }
+        }
+        return true;
+    }
+
+    // Literal text is written out run by run , start is the beginning of
+    // the current run.
+    std::size_t start = 0;
+
+    for( std::size_t i = 0 ; i < text.size() ; ++i ) {
+        if( text.at(i) == '\\' ) {
+            if( i+1 < text.size() && text.at(i+1) == '`' ) {
+                // Drop the backslash , the backtick starts the next run
+                output->AppendLiteral( text.data() + start , i - start );
+                start = ++i;
+            }
+        } else if( text.at(i) == '`' ) {
+            output->AppendLiteral( text.data() + start , i - start );
+            if( !CookTopSegment(text,i,0,&i,output,error) )
+                return false;
+            start = i+1;
+        }
+    }
+    output->AppendLiteral( text.data() + start , text.size() - start );
+    return true;
+}
+
+bool Executor::IsSectionEnabled( int section ) const {
+    if( shared_ != NULL )
+        return shared_->IsSectionEnabled(section);
+    if( variable_map_.HasSection(section) )
+        return variable_map_.IsSectionEnabled(section);
+
+    // Outside of a cook the current version of the publisher is looked at
+    int pin = -1;
+    const ScopeImpl* base = base_;
+    if( base == NULL && publisher_ != NULL )
+        base = publisher_->Acquire(&pin);
+    bool ret = base != NULL ? base->variable_map().IsSectionEnabled(section) :
+                              variable_map_.IsSectionEnabled(section);
+    if( publisher_ != NULL )
+        publisher_->Release(pin);
+    return ret;
+}
+
+bool Executor::SetSectionEnable( int section , bool value ) {
+    if( variable_map_.HasSection(section) )
+        return variable_map_.SetSectionEnable(section,value);
+
+    int pin = -1;
+    const ScopeImpl* base = base_;
+    if( base == NULL && publisher_ != NULL )
+        base = publisher_->Acquire(&pin);
+    bool ret = false;
+    if( base == NULL ) {
+        ret = variable_map_.SetSectionEnable(section,value);
+    } else if( base->variable_map().HasSection(section) ) {
+        // The section of the base is shadowed until the next Clear
+        variable_map_.InsertSection(section,value);
+        ret = true;
+    }
+    if( publisher_ != NULL )
+        publisher_->Release(pin);
+    return ret;
+}
+
+bool Executor::IsSectionEnabled( const std::string& key ) const {
+    return IsSectionEnabled( SymbolTable::Instance()->Find(key) );
+}
+
+bool Executor::EnableSection( const std::string& key ) {
+    return SetSectionEnable( SymbolTable::Instance()->Find(key) , true );
+}
+
+bool Executor::DisableSection( const std::string& key ) {
+    return SetSectionEnable( SymbolTable::Instance()->Find(key) , false );
+}
+
+void Executor::Clear() {
+    const int size = variable_map_.mandu_map_size();
+
+    for( int i = 0 ; i < size ; ++i ) {
+        mandu_pool_.Drop( variable_map_.mandu(i) );
+    }
+
+    variable_map_.Clear();
+    memoized_.clear();
+
+    // Clear the orphand list
+    for( std::vector<Mandu*>::iterator i = orphand_mandus_.begin() ;
+            i != orphand_mandus_.end() ; ++i ) {
+        mandu_pool_.Drop( *i );
+    }
+    orphand_mandus_.clear();
+}
+
+Mandu* Executor::NewMandu( const std::string& section_key , const std::string& key ) {
+    Mandu* new_mandu = mandu_pool_.Grab();
+    SymbolTable* symbols = SymbolTable::Instance();
+    Mandu* ret = variable_map_.InsertMandu( symbols->Intern(section_key) ,
+            symbols->Intern(key) , new_mandu );
+    if( ret != new_mandu ) {
+        mandu_pool_.Drop(ret);
+    } 
+    return new_mandu;
+}
+
+Mandu* Executor::NewMandu( const std::string& key ) {
+    Mandu* new_mandu = mandu_pool_.Grab();
+    Mandu* ret = variable_map_.InsertMandu( SymbolTable::Instance()->Intern(key) , new_mandu );
+    if( ret != new_mandu ) {
+        mandu_pool_.Drop(ret);
+    }
+    return new_mandu;
+}
+
+Mandu* Executor::NewMandu() {
+    Mandu* mandu = mandu_pool_.Grab();
+    orphand_mandus_.push_back( mandu );
+    return mandu;
+}
+
+void Executor::BindProvider( const std::string& section_key , const std::string& key ,
+        VariableProvider* provider , bool memoize ) {
+    NewMandu( section_key , key );
+    SymbolTable* symbols = SymbolTable::Instance();
+    int symbol = symbols->Find(key);
+    VariableMap::Value& value = variable_map_.value(
+            variable_map_.FindValue( symbols->Find(section_key) , symbol ) );
+    value.provider = provider;
+    value.name = &symbols->Name(symbol);
+    value.memoize = memoize;
+}
+
+void Executor::BindProvider( const std::string& key , VariableProvider* provider , bool memoize ) {
+    NewMandu( key );
+    SymbolTable* symbols = SymbolTable::Instance();
+    int symbol = symbols->Find(key);
+    VariableMap::Value& value = variable_map_.value( variable_map_.FindValue( symbol ) );
+    value.provider = provider;
+    value.name = &symbols->Name(symbol);
+    value.memoize = memoize;
+}
+
+int Executor::LookUpVariable( int section , int key ) const {
+    if( key == SymbolTable::kNoSymbol )
+        return -1;
+    if( recorder_ != NULL )
+        recorder_->Record( FragmentCacheImpl::DEPENDENCY_VARIABLE , section , key );
+    if( shared_ != NULL )
+        return shared_->LookUpVariable( section , key );
+
+    // Section before global , at each level this executor before the base
+    int ret;
+    if( IsSectionEnabled(section) ) {
+        ret = variable_map_.FindValue( section , key );
+        if( ret >= 0 )
+            return ret;
+        if( base_ != NULL && (ret = base_->variable_map().FindValue( section , key )) >= 0 )
+            return ret | kBaseSlot;
+    }
+    ret = variable_map_.FindValue( key );
+    if( ret >= 0 )
+        return ret;
+    if( base_ != NULL && (ret = base_->variable_map().FindValue( key )) >= 0 )
+        return ret | kBaseSlot;
+    return -1;
+}
+
+bool Executor::ResolveVariable( int slot , const Mandu** output ) {
+    if( shared_ != NULL ) {
+        if( (slot & kBaseSlot) || shared_->variable_map_.value(slot).provider == NULL )
+            return shared_->ResolveVariable( slot , output );
+        if( recorder_ != NULL )
+            recorder_->cacheable = false;
+        ++volatile_reads_;
+        std::lock_guard<std::mutex> guard(shared_->provider_mutex_);
+        return shared_->ResolveVariable( slot , output );
+    }
+
+    // The base scope only has plain values
+    if( slot & kBaseSlot ) {
+        *output = base_->variable_map().mandu( slot & ~kBaseSlot );
+        return true;
+    }
+
+    VariableMap::Value& value = variable_map_.value(slot);
+
+    // The variable is used in place, no copy is made
+    if( value.provider == NULL || value.resolved ) {
+        *output = value.mandu;
+        return true;
+    }
+
+    // A provided value may change from call to call
+    if( recorder_ != NULL )
+        recorder_->cacheable = false;
+
+    // The provider may bind new variables , so the slot is not held by reference
+    VariableProvider* provider = value.provider;
+    const std::string& key = *value.name;
+    ProfileScope scope(profiler_,Profiler::FRAME_PROVIDER,
+            reinterpret_cast<uintptr_t>(&key),Source(),0,&key);
+    if( value.memoize ) {
+        Mandu* mandu = value.mandu;
+        if( !provider->Provide( key , mandu ) )
+            return false;
+        variable_map_.value(slot).resolved = true;
+        memoized_.push_back(slot);
+        *output = mandu;
+    } else {
+        ++volatile_reads_;
+        Mandu* mandu = NewTemporary();
+        if( !provider->Provide( key , mandu ) )
+            return false;
+        *output = mandu;
+    }
+    return true;
+}
+
+void Executor::ResetMemoized() {
+    for( std::vector<int>::iterator i = memoized_.begin() ; i != memoized_.end() ; ++i ) {
+        variable_map_.value(*i).resolved = false;
+    }
+    memoized_.clear();
+}
+
+bool Executor::ParseNumber( Mandu* val , std::string* error ) {
+    assert( tokenizer_.cur_lexme().token == TK_NUMBER );
+    long lval = 0;
+    std::size_t i;
+
+    // The source may be a file mapping which is not null terminated, so we
+    // cannot use strtol here since it may read pass the end of the mapping.
+    for( i = tokenizer_.position() ; i < tokenizer_.source().size() ; ++i ) {
+        int cha = tokenizer_.source().at(i);
+        if( !std::isdigit(cha) )
+            break;
+        if( lval > (INT_MAX - (cha-'0'))/10 ) {
+            error->assign( ::strerror( ERANGE ) );
+            return false;
+        }
+        lval = lval*10 + (cha-'0');
+    }
+
+    val->SetNumber( static_cast<int>(lval) );
+    // Moving the tokenizer here
+    tokenizer_.Set(i);
+    return true;
+}
+
+bool Executor::ParseVariable( int section , const Mandu** val , std::string* error ) {
+   assert( tokenizer_.cur_lexme().token == TK_VARIABLE );
+
+   // Get variable name from current stream
+   std::size_t i;
+   for( i = tokenizer_.position()+1 ; i < tokenizer_.source().size() ; ++i ) {
+       if( !IsRestVariableChar( tokenizer_.source().at(i) ) ) {
+           break;
+       }
+   }
+   const char* var_name = tokenizer_.source().data() + tokenizer_.position();
+   const std::size_t var_length = i-tokenizer_.position();
+
+   // Look up the variable in the context , a name that is never interned
+   // cannot be bound to anything
+   int slot = LookUpVariable(section,SymbolTable::Instance()->Find(var_name,var_length));
+   if( slot < 0 ) {
+       ReportError(error,"Variable:%s in section:%s is not existed!",
+               std::string(var_name,var_length).c_str(),SectionName(section));
+       return false;
+   }
+
+   // Don't call a provider for a cook which is aborted
+   if( !CheckStack(error) )
+       return false;
+
+   if( !ResolveVariable(slot,val) ) {
+       ReportError(error,"Provider of variable:%s in section:%s failed!",
+               std::string(var_name,var_length).c_str(),SectionName(section));
+       return false;
+   }
+
+   tokenizer_.Set(i);
+
+   // A slice right after the name , eg Rows[100:200]
+   if( IsSlice(i) )
+       return ParseSlice(section,val,error);
+   return true;
+}
+
+bool Executor::IsSlice( std::size_t position ) const {
+    // Without the ":" it is a list sentence following the variable , eg
+    // `Name[1,2]`
+    const Source& source = tokenizer_.source();
+    if( position == source.size() || source.at(position) != '[' )
+        return false;
+    std::size_t i;
+    for( i = position+1 ; i < source.size() ; ++i ) {
+        int cha = source.at(i);
+        if( !std::isspace(cha) && !IsRestVariableChar(cha) )
+            break;
+    }
+    return i < source.size() && source.at(i) == ':';
+}
+
+bool Executor::ParseSlice( int section , const Mandu** val , std::string* error ) {
+    assert( tokenizer_.cur_lexme().token == TK_LSQR );
+    const Mandu* list = *val;
+    std::size_t size;
+    switch( list->type() ) {
+        case Mandu::TYPE_LIST:
+            size = list->ToList().size();
+            break;
+        case Mandu::TYPE_LIST_VIEW:
+        case Mandu::TYPE_INT_ARRAY:
+        case Mandu::TYPE_STRING_COLUMN:
+            size = list->ColumnSize();
+            break;
+        default:
+            ReportError(error,"Only a list could be sliced!");
+            return false;
+    }
+    tokenizer_.Move();
+
+    // A missing bound is the start or the end of the list , and a bound past
+    // the end is the end , so the last page is just shorter
+    std::size_t bounds[2] = { 0 , size };
+    for( int k = 0 ; k < 2 ; ++k ) {
+        const int token = tokenizer_.cur_lexme().token;
+        if( token == TK_NUMBER || token == TK_VARIABLE ) {
+            const Mandu* bound = NULL;
+            if( !ParseAtomic(section,&bound,error) )
+                return false;
+            if( bound->type() != Mandu::TYPE_NUMBER || bound->ToNumber() < 0 ) {
+                ReportError(error,"The bound of a slice must be a number which is not negative!");
+                return false;
+            }
+            bounds[k] = std::min( static_cast<std::size_t>(bound->ToNumber()) , size );
+        }
+        if( tokenizer_.cur_lexme().token != ( k == 0 ? TK_COLON : TK_RSQR ) ) {
+            ReportError(error, k == 0 ? "Expect \":\" in the slice!" :
+                                        "Expect \"]\" to close the slice!");
+            return false;
+        }
+        tokenizer_.Move();
+    }
+
+    Mandu* view = NewTemporary();
+    view->SetListView( *list , bounds[0] , std::max(bounds[0],bounds[1]) );
+    *val = view;
+    return true;
+}
+
+bool Executor::ParseString( Mandu* val , std::string* error ) {
+    assert( tokenizer_.cur_lexme().token == TK_STRING );
+    // Parse the string into the Mandu buffer
+    std::size_t i;
+    std::string output;
+
+    std::size_t len =0;
+
+    // 1. First loop to decide the length of the string. ( This avoid the initial
+    // copy since we are not sure that a SSO string is implemented for libc++ )
+    // And typically such loop is cheaper than initial mallocation ( Suppose that
+    // you have a string which is 31 bytes long, however start with 1->2-->4-->16-->32
+    // which costs you 5 times malloc call).
+
+    for( i = tokenizer_.position()+1 ; i < tokenizer_.source().size() ; ++i ) {
+        int cha = tokenizer_.source().at(i);
+
+        if( cha == '\\' ) {
+            if( IsStringLiteralEscapeChar(i+1) ) {
+                ++len;
+                ++i;
+            } else {
+                ++len;
+            }
+        } else {
+            if( cha == '\"' ) {
+                break;
+            } else {
+                ++len;
+            }
+        }
+    }
+
+    if( i == tokenizer_.source().size() ) {
+        ReportError(error,"The string literal is not closed by \"");
+        return false;
+    }
+
+    output.reserve(len);
+
+    // 2. Copy the data into the buffer
+    for( i = tokenizer_.position()+1 ; i < tokenizer_.source().size() ; ++i ) {
+        int cha = tokenizer_.source().at(i);
+
+        if( cha  == '\\' ) {
+            if( IsStringLiteralEscapeChar( i+1 ) ) {
+                output.push_back( tokenizer_.source().at(i+1) );
+                i++;
+            } else {
+                output.push_back( cha );
+            }
+        } else {
+            if( tokenizer_.source().at(i) == '\"' ) {
+                break;
+            } else {
+                output.push_back(cha);
+            }
+        }
+    }
+    val->SetString(std::move(output));
+    // Move the tokenizer
+    tokenizer_.Set(i+1);
+    return true;
+}
+
+bool Executor::ParseAtomic( int section , const Mandu** val , std::string* error ) {
+    switch( tokenizer_.cur_lexme().token ) {
+        case TK_NUMBER:
+            {
+                Mandu* number = NewTemporary();
+                *val = number;
+                return ParseNumber(number,error);
+            }
+        case TK_STRING:
+            {
+                Mandu* str = NewTemporary();
+                *val = str;
+                return ParseString(str,error);
+            }
+        case TK_VARIABLE:
+            return ParseVariable(section,val,error);
+        default:
+            UNREACHABLE(return false);
+    }
+}
+
+int Executor::ParseListElement( int section , const Mandu** from , const Mandu** to ,
+       std::vector<const Mandu*>* output , std::string* error  ) {
+    // ListElement means a single element in the list, it optionally can be a range value or
+    // a single value. The single value could be an atomic value or another list
+    switch( tokenizer_.cur_lexme().token ) {
         case TK_NUMBER:
         case TK_STRING:
         case TK_VARIABLE:
@@ -1047,409 +4068,1872 @@ int Executor::ParseListElement( const std::string& section , Mandu* from , Mandu
                 return ELEMENT_FAIL;
             break;
 
-        case TK_LSQR:
-            return ParseList(section,output,error) ? ELEMENT_LIST : ELEMENT_FAIL;
-        default:
-            UNREACHABLE(return ELEMENT_FAIL);
+        case TK_LSQR:
+            return ParseList(section,output,error) ? ELEMENT_LIST : ELEMENT_FAIL;
+        default:
+            UNREACHABLE(return ELEMENT_FAIL);
+    }
+    // Now cehck if we have optional - to indicate it is a range operation
+    if( tokenizer_.cur_lexme().token == TK_SUB ) {
+        // It is a range operation here, checking the from must be a number
+        if( (*from)->type() != Mandu::TYPE_NUMBER ) {
+            ReportError(error,"The range operation must comes with 2 number operands");
+            return ELEMENT_FAIL;
+        }
+        // Parsing the next one
+        tokenizer_.Move();
+        if( !ParseAtomic(section,to,error) )
+            return ELEMENT_FAIL;
+        else {
+            // Checking whether the to mandu is a number or not
+            if( (*to)->type() != Mandu::TYPE_NUMBER ) {
+                ReportError(error,"The range operation must comes with 2 number operands");
+                return ELEMENT_FAIL;
+            } else {
+                if( (*from)->ToNumber() >= (*to)->ToNumber() ) {
+                    ReportError(error,"The left hand operand of range MUST BE "
+                                      "LESS than the right hand operand of range!");
+                    return ELEMENT_FAIL;
+                }
+            }
+        }
+        return ELEMENT_RANGE;
+    } else {
+        return ELEMENT_ATOMIC;
+    }
+
+}
+
+bool Executor::ParseFilter( int* filter , std::string* error ) {
+    assert( tokenizer_.cur_lexme().token == TK_PIPE );
+    tokenizer_.Move();
+    if( tokenizer_.cur_lexme().token != TK_VARIABLE ) {
+        ReportError(error,"Expect filter name after \"|\"!");
+        return false;
+    }
+
+    std::size_t i;
+    for( i = tokenizer_.position()+1 ; i < tokenizer_.source().size() ; ++i ) {
+        if( !IsRestVariableChar( tokenizer_.source().at(i) ) )
+            break;
+    }
+    *filter = FindFilter( tokenizer_.source().data() + tokenizer_.position() ,
+            i - tokenizer_.position() );
+    if( *filter == FILTER_NONE ) {
+        std::string name( tokenizer_.source().data() + tokenizer_.position() ,
+                i - tokenizer_.position() );
+        ReportError(error,"Unknown filter:%s!",name.c_str());
+        return false;
+    }
+    tokenizer_.Set(i);
+    return true;
+}
+
+bool Executor::ParseList( int section , std::vector<const Mandu*>* outputs , std::string* error ) {
+    assert( tokenizer_.cur_lexme().token == TK_LSQR );
+    tokenizer_.Move();
+    // Quick test for empty list and then report error
+    if( tokenizer_.cur_lexme().token == TK_RSQR ) {
+        ReportError(error,"Empty list,what's the point!");
+        return false;
+    }
+
+    do {
+        const Mandu* from = NULL;
+        const Mandu* to = NULL;
+
+        // The temporary mandus created here are dropped by the caller
+        switch( ParseListElement(section,&from,&to,outputs,error) ) {
+            case ELEMENT_FAIL:
+                return false;
+            case ELEMENT_ATOMIC:
+                outputs->push_back( from );
+                break;
+            case ELEMENT_RANGE:
+                {
+                    int from_count = from->ToNumber();
+                    int to_count = to->ToNumber();
+                    for( ; from_count < to_count ; ++from_count ) {
+                        outputs->push_back( NewTemporary(from_count) );
+                    }
+                    break;
+                }
+            case ELEMENT_LIST:
+                break;
+            default:
+                UNREACHABLE(return false);
+        }
+        if( tokenizer_.cur_lexme().token == TK_COMMA ) {
+            // Continue looping
+            tokenizer_.Move();
+            continue;
+        } else if( tokenizer_.cur_lexme().token == TK_RSQR ) {
+            tokenizer_.Move();
+            break;
+        } else {
+            ReportError(error,"Unexpected element in list");
+            return false;
+        }
+    } while(true);
+    return true;
+}
+
+bool Executor::CheckStack( std::string* error ) {
+    // The stack grows down , the address of a local is the current depth
+    char marker;
+    if( aborted_ ) {
+        ReportError(error,"The cook is aborted!");
+        return false;
+    }
+    if( stack_limit_ != 0 && reinterpret_cast<uintptr_t>(&marker) < stack_limit_ ) {
+        ReportError(error,"The template is nested too deep for the stack of the cursor!");
+        return false;
+    }
+    return true;
+}
+
+bool Executor::ExecuteListBody( const Source& source, std::size_t position , std::size_t* offset ,
+        const Mandu* const* begin , const Mandu* const* end , int filter ,
+        Output* output , std::string* error ) {
+    if( !CheckStack(error) )
+        return false;
+    for( const Mandu* const* ib = begin ; ib != end ; ++ib ) {
+        const Mandu* m = *ib;
+        switch( m->type() ) {
+            case Mandu::TYPE_LIST:
+                {
+                    // This is a list, just executing this list again
+                    const std::vector<Mandu*>& l = m->ToList();
+                    if(!ExecuteListBody(source,position,offset,
+                                l.data(),l.data()+l.size(),filter,output,error))
+                        return false;
+                    break;
+                }
+            case Mandu::TYPE_LIST_VIEW:
+                if(!ExecuteListBody(source,position,offset,m->ToListView(),
+                            m->ToListView()+m->ColumnSize(),filter,output,error))
+                    return false;
+                break;
+            case Mandu::TYPE_INT_ARRAY:
+                {
+                    const int64_t* array = m->ToIntArray();
+                    for( std::size_t i = 0 ; i < m->ColumnSize() ; ++i ) {
+                        if(!ExecuteBody( Dollar(array[i],filter) , source , position , offset , output , error ))
+                            return false;
+                    }
+                    break;
+                }
+            case Mandu::TYPE_STRING_COLUMN:
+                {
+                    for( std::size_t i = 0 ; i < m->ColumnSize() ; ++i ) {
+                        std::size_t length;
+                        const char* str = m->ColumnString(i,&length);
+                        if(!ExecuteBody( Dollar(str,length,filter) , source , position , offset , output , error ))
+                            return false;
+                    }
+                    break;
+                }
+            case Mandu::TYPE_GENERATOR:
+                if(!ExecuteGeneratorBody(source,position,offset,
+                            m->ToGenerator(),filter,output,error))
+                    return false;
+                break;
+            default:
+                if(!ExecuteBody( Dollar(*m,filter) , source , position , offset , output , error )) {
+                    return false;
+                }
+                break;
+        }
+    }
+    return true;
+}
+
+bool Executor::ExecuteGeneratorBody( const Source& source, std::size_t position , std::size_t* offset ,
+        ListGenerator* generator , int filter , Output* output , std::string* error ) {
+    if( shared_ != NULL ) {
+        generator_read_ = true;
+        ReportError(error,"A generator is read by a parallel cook!");
+        return false;
+    }
+
+    if( std::find( iterating_.begin() , iterating_.end() , generator ) != iterating_.end() ) {
+        ReportError(error,"A generator is iterated again inside of its own body!");
+        return false;
+    }
+
+    // Only one element is alive at a time , the generator refills it for
+    // each iteration.
+    ++volatile_reads_;
+    Mandu* element = NewTemporary();
+    const Mandu* e = element;
+    bool ret = false;
+
+    iterating_.push_back(generator);
+    generator->Rewind();
+    while( generator->Next(element) ) {
+        if(!ExecuteListBody(source,position,offset,&e,&e+1,filter,output,error))
+            goto done;
+        if( reentered_ ) {
+            reentered_ = false;
+            ReportError(error,"A generator is written out inside of its own body!");
+            goto done;
+        }
+    }
+    ret = true;
+
+done:
+    iterating_.pop_back();
+    if( iterating_.empty() )
+        reentered_ = false;
+    return ret;
+}
+
+void Executor::AppendValue( const Mandu& value , Output* output ) {
+    static const char kNone[] = "<:null:>";
+    switch( value.type() ) {
+        case Mandu::TYPE_NONE:
+            output->Append( kNone , sizeof(kNone)-1 );
+            return;
+        case Mandu::TYPE_NUMBER:
+            output->Append( value.number_.text , value.number_.length );
+            return;
+        case Mandu::TYPE_STRING:
+            output->AppendString( value.ToString() );
+            return;
+        case Mandu::TYPE_LIST:
+        case Mandu::TYPE_RECORD:
+            {
+                // A record is written as its fields
+                const std::vector<Mandu*>& l = value.type() == Mandu::TYPE_LIST ?
+                    value.ToList() : value.ToRecordFields();
+                for( std::vector<Mandu*>::const_iterator i = l.begin() ; i != l.end() ; ++i ) {
+                    AppendValue( **i , output );
+                }
+                return;
+            }
+        case Mandu::TYPE_LIST_VIEW:
+            for( std::size_t i = 0 ; i < value.ColumnSize() ; ++i ) {
+                AppendValue( *value.ToListView()[i] , output );
+            }
+            return;
+        case Mandu::TYPE_INT_ARRAY:
+            for( std::size_t i = 0 ; i < value.ColumnSize() ; ++i ) {
+                AppendInteger( value.ToIntArray()[i] , output );
+            }
+            return;
+        case Mandu::TYPE_STRING_COLUMN:
+            // The strings are contiguous inside of the table
+            if( value.ColumnSize() != 0 ) {
+                const std::size_t* offsets = value.column_.offsets;
+                output->Append( static_cast<const char*>(value.column_.data) + offsets[0] ,
+                        offsets[value.ColumnSize()] - offsets[0] );
+            }
+            return;
+        case Mandu::TYPE_GENERATOR:
+            {
+                // A helper leaves the generator to the sequential cook
+                if( shared_ != NULL ) {
+                    generator_read_ = true;
+                    return;
+                }
+                ListGenerator* generator = value.ToGenerator();
+                // The body iterating it fails the cook afterwards
+                if( std::find( iterating_.begin() , iterating_.end() , generator ) != iterating_.end() ) {
+                    reentered_ = true;
+                    return;
+                }
+                ++volatile_reads_;
+                Mandu* element = NewTemporary();
+                generator->Rewind();
+                while( generator->Next(element) ) {
+                    AppendValue( *element , output );
+                }
+                return;
+            }
+        default:
+            UNREACHABLE(return);
+    }
+}
+
+void Executor::AppendDollar( const Dollar& dollar , Output* output ) {
+    switch( dollar.type ) {
+        case Dollar::DOLLAR_MANDU:
+            AppendValue( *dollar.mandu , output );
+            return;
+        case Dollar::DOLLAR_INTEGER:
+            AppendInteger( dollar.integer , output );
+            return;
+        case Dollar::DOLLAR_STRING:
+            output->Append( dollar.str , dollar.length );
+            return;
+        default:
+            UNREACHABLE(return);
+    }
+}
+
+bool Executor::ExecuteList( int section , Output* output , std::string* error ) {
+    assert( tokenizer_.cur_lexme().token == TK_LSQR );
+    const std::size_t mark = temporaries_.size();
+    std::vector<const Mandu*> list;
+    int filter = FILTER_NONE;
+    bool ret = false;
+
+    if( !ParseList(section,&list,error) )
+        goto done;
+
+    if( tokenizer_.cur_lexme().token == TK_PIPE && !ParseFilter(&filter,error) )
+        goto done;
+
+    // Check wether we need to execute the body or just output the string here
+    if( tokenizer_.cur_lexme().token == TK_LBRA ) {
+        tokenizer_.Move();
+        std::size_t start_position = tokenizer_.position();
+        std::size_t end_position = 0;
+
+        if( !ExecuteListBody(tokenizer_.source(),start_position,
+                    &end_position,list.data(),list.data()+list.size(),filter,output,error) )
+            goto done;
+
+        // The body is never executed if the list has no element at all, for
+        // example an empty columnar list , find where it ends here.
+        if( end_position == 0 && !SkipBody(tokenizer_.source(),start_position,&end_position) ) {
+            ReportError(error,"Unexpected end of the stream!Expecting \"}\"");
+            goto done;
+        }
+        tokenizer_.Set(end_position);
+    } else {
+        // Just dump the list into the output is fine
+        FilterOutput filtered(output,filter);
+        for( std::vector<const Mandu*>::iterator ib = list.begin() ; ib != list.end() ; ++ib ) {
+            AppendValue( **ib , filter == FILTER_NONE ? output : &filtered );
+        }
+    }
+    ret = true;
+
+done:
+    DropTemporary(mark);
+    return ret;
+}
+
+bool Executor::ExecuteAtomic( int section , Output* output , std::string* error ) {
+    const std::size_t mark = temporaries_.size();
+    const Mandu* atomic = NULL;
+    int filter = FILTER_NONE;
+    bool ret = false;
+
+    if( !ParseAtomic(section,&atomic,error) )
+        goto done;
+
+    if( tokenizer_.cur_lexme().token == TK_PIPE && !ParseFilter(&filter,error) )
+        goto done;
+
+    if( tokenizer_.cur_lexme().token == TK_LBRA ) {
+        tokenizer_.Move();
+        std::size_t start_position = tokenizer_.position();
+        std::size_t end_position = 0;
+
+        if(!ExecuteBody(Dollar(*atomic,filter),tokenizer_.source(),start_position,
+                    &end_position,output,error)) {
+            goto done;
+        }
+        tokenizer_.Set(end_position);
+    } else if( filter != FILTER_NONE ) {
+        FilterOutput filtered(output,filter);
+        AppendValue( *atomic , &filtered );
+    } else {
+        AppendValue( *atomic , output );
+    }
+    ret = true;
+
+done:
+    DropTemporary(mark);
+    return ret;
+}
+
+bool Executor::ExecuteBody( const Dollar& dollar_sign , const Source& source , std::size_t position ,
+        std::size_t* offset , Output* output , std::string* error ) {
+    if( !CheckStack(error) )
+        return false;
+    ProfileScope scope(profiler_,Profiler::FRAME_BODY,position,source,position);
+
+    // Start of the current literal run inside of the body
+    std::size_t start = position;
+
+    for( std::size_t i = position ; i < source.size() ; ++i ) {
+        int cha = source.at(i);
+        if( cha == '\\' ) {
+            if( IsBodyEscapeChar(source,i+1) ) {
+                // It is the escape character we need to skip here, the
+                // escaped character starts the next run
+                output->AppendLiteral( source.data() + start , i - start );
+                start = ++i;
+            }
+        } else {
+            if( cha == '$' ) {
+                // Do the substitution here
+                output->AppendLiteral( source.data() + start , i - start );
+
+                // Field of a record , eg $.name. For any other $ the ".name"
+                // is just text , eg www.$.com
+                const Mandu* field = NULL;
+                if( i+2 < source.size() && source.at(i+1) == '.' &&
+                    IsInitialVariableChar(source.at(i+2)) &&
+                    dollar_sign.type == Dollar::DOLLAR_MANDU &&
+                    dollar_sign.mandu->type() == Mandu::TYPE_RECORD ) {
+                    if( !LookUpField( dollar_sign , source , i+1 , &i , &field , error ) )
+                        return false;
+                }
+
+                // Optional filter of the substitution , eg $|html. A name that
+                // is not a filter is just kept as text.
+                int filter = dollar_sign.filter;
+                if( i+1 < source.size() && source.at(i+1) == '|' ) {
+                    std::size_t e;
+                    for( e = i+2 ; e < source.size() && IsRestVariableChar(source.at(e)) ; ++e )
+                        ;
+                    int f = FindFilter( source.data()+i+2 , e-i-2 );
+                    if( f != FILTER_NONE ) {
+                        filter = f;
+                        i = e-1;
+                    }
+                }
+
+                if( filter != FILTER_NONE ) {
+                    FilterOutput filtered(output,filter);
+                    if( field != NULL )
+                        AppendValue(*field,&filtered);
+                    else
+                        AppendDollar(dollar_sign,&filtered);
+                } else {
+                    if( field != NULL )
+                        AppendValue(*field,output);
+                    else
+                        AppendDollar(dollar_sign,output);
+                }
+                start = i+1;
+            } else if( cha == '`' ) {
+                // Call Cook again however we need to save the current
+                // tokenizer_ context to resume the usage later on
+                output->AppendLiteral( source.data() + start , i - start );
+                Tokenizer tk(tokenizer_);
+                // The partials of the segment see this $
+                const Dollar* dollar = dollar_;
+                dollar_ = &dollar_sign;
+                bool ret = CookNestedSegment( source , i , &i , output , error );
+                dollar_ = dollar;
+                if( !ret )
+                    return false;
+                else {
+                    tokenizer_ = tk;
+                }
+                start = i+1;
+            } else if( cha == '}' ) {
+                // End of the body expression here. Just return here
+                output->AppendLiteral( source.data() + start , i - start );
+                *offset = i+1;
+                return true;
+            }
+        }
+    }
+    // If we reach here , it means we meet an unexceptional EOF of the stream
+    ReportError(error,"Unexpected end of the stream!Expecting \"}\"");
+    return false;
+}
+
+Executor::HoistedSegment* Executor::FindHoistedSegment( const char* at , int section ) {
+    const std::pair<const char*,int> key(at,section);
+    std::vector<HoistedSegment>::iterator iter = std::lower_bound(
+            hoisted_.begin() , hoisted_.end() , key );
+    if( iter != hoisted_.end() && iter->at == at && iter->section == section )
+        return &*iter;
+    HoistedSegment hoisted;
+    hoisted.at = at;
+    hoisted.section = section;
+    hoisted.state = HoistedSegment::HOIST_UNKNOWN;
+    hoisted.end = 0;
+    hoisted.recording = 0;
+    return &*hoisted_.insert( iter , hoisted );
+}
+
+bool Executor::CookNestedSegment( const Source& source , std::size_t position , std::size_t* end ,
+        Output* output , std::string* error ) {
+    // The default section of the segment is part of the key , a partial may
+    // be included from several sections
+    HoistedSegment* hoisted = FindHoistedSegment( source.data() + position , section_ );
+    if( hoisted->state == HoistedSegment::HOIST_REPLAY &&
+        ( recorder_ == NULL || hoisted->recording == recording_ ) ) {
+        output->AppendString( hoisted->text );
+        *end = hoisted->end;
+        return true;
+    }
+    if( hoisted->state == HoistedSegment::HOIST_NEVER )
+        return CookSegment( source , position , end , output , error );
+
+    // A partial at the level of the segment itself sees the $ of the body ,
+    // the ones inside of the bodies of the segment see their own $
+    bool invariant = true;
+    for( std::size_t i = position+1 ; i < source.size() && invariant &&
+            hoisted->state == HoistedSegment::HOIST_UNKNOWN ; ++i ) {
+        int cha = source.at(i);
+        if( cha == '`' ) {
+            break;
+        } else if( cha == '@' ) {
+            invariant = false;
+        } else if( cha == '"' ) {
+            for( ++i ; i < source.size() && source.at(i) != '"' ; ++i ) {
+                if( source.at(i) == '\\' && i+1 < source.size() &&
+                    IsExecutorStringLiteralEscapeChar( source.at(i+1) ) )
+                    ++i;
+            }
+        } else if( cha == '{' ) {
+            if( !SkipBody( source , i+1 , &i ) )
+                invariant = false;
+            else
+                --i;
+        }
+    }
+    if( !invariant ) {
+        hoisted->state = HoistedSegment::HOIST_NEVER;
+        return CookSegment( source , position , end , output , error );
+    }
+
+    // The nested cooks may move the entry
+    const int section = section_;
+    const std::size_t volatile_reads = volatile_reads_;
+    TeeOutput tee(output);
+    if( !CookSegment( source , position , end , &tee , error ) )
+        return false;
+    hoisted = FindHoistedSegment( source.data() + position , section );
+    if( volatile_reads_ != volatile_reads ) {
+        hoisted->state = HoistedSegment::HOIST_NEVER;
+    } else {
+        hoisted->state = HoistedSegment::HOIST_REPLAY;
+        hoisted->end = *end;
+        hoisted->text.swap( tee.text );
+        if( recorder_ != NULL )
+            hoisted->recording = recording_;
+    }
+    return true;
+}
+
+bool Executor::LookUpField( const Dollar& dollar_sign , const Source& source , std::size_t position ,
+        std::size_t* last , const Mandu** field , std::string* error ) {
+    assert( source.at(position) == '.' );
+    std::size_t e;
+    for( e = position+1 ; e < source.size() && IsRestVariableChar(source.at(e)) ; ++e )
+        ;
+    const char* name = source.data() + position + 1;
+    const std::size_t length = e - position - 1;
+    *last = e-1;
+
+    assert( dollar_sign.type == Dollar::DOLLAR_MANDU &&
+            dollar_sign.mandu->type() == Mandu::TYPE_RECORD );
+    const RecordLayout* layout = dollar_sign.mandu->ToRecordLayout();
+
+    // The position of the field is resolved once for this place of the
+    // template and each layout it meets , the rows just read it
+    std::vector<FieldSlot>::iterator iter = std::lower_bound(
+            fields_.begin() , fields_.end() , std::make_pair(name,layout) );
+    if( iter == fields_.end() || iter->at != name || iter->layout != layout ) {
+        FieldSlot slot = { name , layout , layout->FindField(name,length) };
+        iter = fields_.insert( iter , slot );
+    }
+    if( iter->index < 0 ) {
+        ReportError(error,"Field:%s is not existed in the record!",
+                std::string(name,length).c_str());
+        return false;
+    }
+    *field = dollar_sign.mandu->ToRecordFields()[iter->index];
+    return true;
+}
+
+bool Executor::ExecutePartial( int section , Output* output , std::string* error ) {
+    assert( tokenizer_.cur_lexme().token == TK_PARTIAL );
+    tokenizer_.Move();
+    if( tokenizer_.cur_lexme().token != TK_VARIABLE ) {
+        ReportError(error,"Expect partial name after \"@\"!");
+        return false;
+    }
+
+    std::size_t i;
+    for( i = tokenizer_.position()+1 ; i < tokenizer_.source().size() ; ++i ) {
+        if( !IsRestVariableChar( tokenizer_.source().at(i) ) )
+            break;
+    }
+    std::string name( tokenizer_.source().data() + tokenizer_.position() ,
+            i - tokenizer_.position() );
+    std::vector<Partial*>::const_iterator iter = std::lower_bound(
+            partials().begin() , partials().end() , name , PartialLess() );
+    if( iter == partials().end() || (*iter)->name != name ) {
+        ReportError(error,"Partial:%s is not existed!",name.c_str());
+        return false;
+    }
+    if( partial_depth_ == kMaxPartialDepth ) {
+        ReportError(error,"Partial:%s is nested too deep!",name.c_str());
+        return false;
+    }
+    if( !CheckStack(error) )
+        return false;
+    tokenizer_.Set(i);
+    if( recorder_ != NULL ) {
+        recorder_->Record( FragmentCacheImpl::DEPENDENCY_PARTIAL , 0 ,
+                SymbolTable::Instance()->Intern(name) );
+    }
+
+    // The partial runs as a body with the $ of the caller , at the top level
+    // the $ is empty.
+    const Dollar empty( "" , 0 , FILTER_NONE );
+    const int section_saved = section_;
+    Tokenizer tk(tokenizer_);
+    std::size_t end;
+    bool ret;
+
+    ProfileScope scope(profiler_,Profiler::FRAME_PARTIAL,
+            reinterpret_cast<uintptr_t>(*iter),Source(),0,&(*iter)->name);
+    section_ = section;
+    ++partial_depth_;
+    ret = ExecuteBody( dollar_ != NULL ? *dollar_ : empty ,
+            Source((*iter)->text) , 0 , &end , output , error );
+    --partial_depth_;
+    section_ = section_saved;
+    if( ret )
+        tokenizer_ = tk;
+    return ret;
+}
+
+bool Executor::RegisterPartial( const std::string& name , const std::string& text ,
+        std::string* error ) {
+    if( name.empty() || !IsInitialVariableChar( name[0] ) ) {
+        error->assign("Invalid partial name!");
+        return false;
     }
-    // Now cehck if we have optional - to indicate it is a range operation
-    if( tokenizer_.cur_lexme().token == TK_SUB ) {
-        // It is a range operation here, checking the from must be a number
-        if( from->type() != Mandu::TYPE_NUMBER ) {
-            ReportError(error,"The range operation must comes with 2 number operands");
-            return ELEMENT_FAIL;
+    for( std::size_t i = 1 ; i < name.size() ; ++i ) {
+        if( !IsRestVariableChar( name[i] ) ) {
+            error->assign("Invalid partial name!");
+            return false;
         }
-        // Parsing the next one
+    }
+
+    Partial* partial = new Partial();
+    partial->name = name;
+    if( minify_whitespace_ )
+        MinifyWhitespace( Source(text) , &partial->text );
+    else
+        partial->text = text;
+    partial->text.push_back('}');
+
+    // The text must be a body on its own , the ending "}" is ours
+    std::size_t end;
+    if( !SkipBody( Source(partial->text) , 0 , &end ) || end != partial->text.size() ) {
+        error->assign("Partial:" + name + " is not a valid body!");
+        delete partial;
+        return false;
+    }
+
+    std::vector<Partial*>::iterator iter = std::lower_bound(
+            partials_.begin() , partials_.end() , name , PartialLess() );
+    if( iter != partials_.end() && (*iter)->name == name ) {
+        delete *iter;
+        *iter = partial;
+    } else {
+        partials_.insert(iter,partial);
+    }
+    return true;
+}
+
+bool Executor::RemovePartial( const std::string& name ) {
+    std::vector<Partial*>::iterator iter = std::lower_bound(
+            partials_.begin() , partials_.end() , name , PartialLess() );
+    if( iter == partials_.end() || (*iter)->name != name )
+        return false;
+    delete *iter;
+    partials_.erase(iter);
+    return true;
+}
+
+bool Executor::Execute( Output* output , std::string* error ) {
+    const std::size_t mark = temporaries_.size();
+    Mandu* section_key = NewTemporary();
+    // Inside of a partial the section of the caller is the default one
+    int section = section_;
+    bool ret = false;
+
+    if( tokenizer_.cur_lexme().token == TK_SECTION_START ) {
+        // Parsing the section key here
         tokenizer_.Move();
-        if( !ParseAtomic(section,to,error) )
-            return ELEMENT_FAIL;
-        else {
-            // Checking whether the to mandu is a number or not
-            if( to->type() != Mandu::TYPE_NUMBER ) {
-                ReportError(error,"The range operation must comes with 2 number operands");
-                return ELEMENT_FAIL;
-            } else {
-                if( from->ToNumber() >= to->ToNumber() ) {
-                    ReportError(error,"The left hand operand of range MUST BE "
-                                      "LESS than the right hand operand of range!");
-                    return ELEMENT_FAIL;
+        if( tokenizer_.cur_lexme().token != TK_STRING ) {
+            ReportError(error,"Expect section key!");
+            goto done;
+        }
+        if( !ParseString( section_key , error ) )
+            goto done;
+
+        // Now we have got our section key , just start the execution here
+        if( tokenizer_.cur_lexme().token == TK_END ) {
+            ReportError(error,"Unexpected end of the stream with empty section body!");
+            goto done;
+        }
+
+        // Now just check whether such section key is existed or not
+        section = SymbolTable::Instance()->Find( section_key->ToString() );
+        if( recorder_ != NULL )
+            recorder_->Record( FragmentCacheImpl::DEPENDENCY_SECTION , section , 0 );
+        if( !IsSectionEnabled(section) ) {
+            SectionSkipper skipper(
+                    tokenizer_.source(), tokenizer_.position() );
+            std::size_t end;
+            if( skipper.Skip(&end,error) ) {
+                tokenizer_.Set(end);
+                // Now we have correctly skipped the body , just return
+                ret = true;
+            }
+            goto done;
+        }
+    }
+
+    // Start to run the body here
+    do {
+        switch( tokenizer_.cur_lexme().token ) {
+            case TK_NUMBER:
+            case TK_STRING:
+            case TK_VARIABLE:
+                if( !ExecuteAtomic(section,output,error) ) {
+                    goto done;
+                }
+                break;
+            case TK_LSQR:
+                if( !ExecuteList(section,output,error) ) {
+                    goto done;
+                }
+                break;
+            case TK_PARTIAL:
+                if( !ExecutePartial(section,output,error) ) {
+                    goto done;
+                }
+                break;
+            default:
+                ret = true;
+                goto done;
+        }
+        // Now check whether we can exit the loop or not
+        switch( tokenizer_.cur_lexme().token ) {
+            case TK_END:
+                ret = true;
+                goto done;
+            case TK_SECTION_END:
+                tokenizer_.Move();
+                ret = true;
+                goto done;
+            default:
+                break;
+        }
+    } while(true);
+
+done:
+    DropTemporary(mark);
+    return ret;
+}
+
+bool Executor::DoExecute( Output* output, std::string* error ) {
+    do {
+        if( !Execute(output,error) )
+            return false;
+        switch( tokenizer_.cur_lexme().token ) {
+            case TK_STRING:
+            case TK_NUMBER:
+            case TK_VARIABLE:
+            case TK_LSQR:
+            case TK_PARTIAL:
+            case TK_SECTION_START:
+                break;
+            case TK_END:
+                return true;
+            default:
+                // error comes here now
+                ReportError(error,"Unexpected token here!");
+                return false;
+        }
+    } while( true );
+}
+// CursorImpl runs the executor on its own stack , so the evaluation can be
+// suspended at any point when the caller's buffer is full and resumed later.
+class CursorImpl : public Output {
+public:
+    // Room kept below the checked depth for the frames between two checks ,
+    // error reporting and the output
+    static const std::size_t kStackReserve = 64*1024;
+
+    CursorImpl( Executor* executor , const Source& source , std::size_t stack_size ,
+            const TemplatePiece* pieces = NULL , std::size_t piece_count = 0 ):
+        executor_( executor ),
+        source_( source ),
+        pieces_( pieces ),
+        piece_count_( piece_count ),
+        stack_( NULL ),
+        stack_size_( stack_size ),
+        guard_size_(0),
+        buffer_( NULL ),
+        capacity_(0),
+        used_(0),
+        started_( false ),
+        done_( false ),
+        result_( false ),
+        aborted_( false ),
+        error_()
+    {}
+
+    ~CursorImpl();
+
+    bool Next( char* buffer , std::size_t capacity , std::size_t* length , std::string* error );
+
+    bool IsDone() const {
+        return done_;
+    }
+
+    virtual void Append( const char* str , std::size_t length );
+
+private:
+    // makecontext only passes int arguments , so the pointer is split
+    static void Entry( int hi , int lo );
+
+    void Run() {
+        executor_->set_stack_limit( reinterpret_cast<uintptr_t>(stack_) + guard_size_ + kStackReserve );
+        result_ = executor_->Cook( source_ , this , &error_ , pieces_ , piece_count_ );
+        executor_->set_stack_limit(0);
+        executor_->set_aborted(false);
+        done_ = true;
+        // Return to the caller through uc_link
+    }
+
+    void Resume() {
+        swapcontext( &caller_ , &callee_ );
+    }
+
+    void Yield() {
+        swapcontext( &callee_ , &caller_ );
+    }
+
+private:
+    Executor* executor_;
+    Source source_;
+    const TemplatePiece* pieces_;
+    std::size_t piece_count_;
+
+    // Private stack of the evaluation , the lowest guard_size_ bytes are a
+    // guard page which is never accessible
+    char* stack_;
+    std::size_t stack_size_;
+    std::size_t guard_size_;
+    ucontext_t caller_;
+    ucontext_t callee_;
+
+    // Caller's buffer of the current Next call
+    char* buffer_;
+    std::size_t capacity_;
+    std::size_t used_;
+
+    bool started_;
+    bool done_;
+    bool result_;
+    // Set when the cursor is dropped , the output is discarded and the
+    // executor fails the cook at its next check
+    bool aborted_;
+    std::string error_;
+};
+
+CursorImpl::~CursorImpl() {
+    if( started_ && !done_ ) {
+        // Fail the cook so the private stack unwinds and everything on it
+        // is released properly , the rest of the page is not evaluated
+        aborted_ = true;
+        executor_->set_aborted(true);
+        Resume();
+        assert( done_ );
+    }
+    if( stack_ != NULL )
+        munmap( stack_ , guard_size_ + stack_size_ );
+}
+
+void CursorImpl::Entry( int hi , int lo ) {
+    uintptr_t ptr = ( ( static_cast<uintptr_t>( static_cast<unsigned int>(hi) ) << 16 ) << 16 ) |
+        static_cast<uintptr_t>( static_cast<unsigned int>(lo) );
+    reinterpret_cast<CursorImpl*>(ptr)->Run();
+}
+
+void CursorImpl::Append( const char* str , std::size_t length ) {
+    while( !aborted_ && length > 0 ) {
+        if( used_ == capacity_ ) {
+            // Buffer is full , suspend until the next Next call
+            Yield();
+            continue;
+        }
+        std::size_t sz = std::min( length , capacity_ - used_ );
+        memcpy( buffer_ + used_ , str , sz );
+        used_ += sz;
+        str += sz;
+        length -= sz;
+    }
+}
+
+bool CursorImpl::Next( char* buffer , std::size_t capacity , std::size_t* length , std::string* error ) {
+    *length = 0;
+    if( done_ ) {
+        if( !result_ )
+            error->assign( error_ );
+        return result_;
+    }
+    if( capacity == 0 )
+        return true;
+
+    buffer_ = buffer;
+    capacity_ = capacity;
+    used_ = 0;
+
+    if( !started_ ) {
+        // The pages of the stack are only committed once they are touched ,
+        // an overflow past the depth check hits the guard page
+        const std::size_t page = static_cast<std::size_t>( sysconf(_SC_PAGESIZE) );
+        guard_size_ = page;
+        stack_size_ = std::max( ( stack_size_ + page - 1 ) / page * page , kStackReserve + page );
+        void* stack = mmap( NULL , guard_size_ + stack_size_ , PROT_READ | PROT_WRITE ,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE , -1 , 0 );
+        if( stack == MAP_FAILED ) {
+            error->assign("Cannot allocate the stack of the cursor!");
+            return false;
+        }
+        stack_ = static_cast<char*>(stack);
+        if( mprotect( stack_ , guard_size_ , PROT_NONE ) != 0 ) {
+            munmap( stack_ , guard_size_ + stack_size_ );
+            stack_ = NULL;
+            error->assign("Cannot protect the stack of the cursor!");
+            return false;
+        }
+        getcontext( &callee_ );
+        callee_.uc_stack.ss_sp = stack_ + guard_size_;
+        callee_.uc_stack.ss_size = stack_size_;
+        callee_.uc_link = &caller_;
+        uintptr_t ptr = reinterpret_cast<uintptr_t>(this);
+        makecontext( &callee_ , reinterpret_cast<void (*)()>( &CursorImpl::Entry ) , 2 ,
+                static_cast<int>( ( ptr >> 16 ) >> 16 ) , static_cast<int>( ptr & 0xffffffff ) );
+        started_ = true;
+    }
+    Resume();
+
+    *length = used_;
+    buffer_ = NULL;
+    capacity_ = used_ = 0;
+
+    if( done_ && !result_ ) {
+        error->assign( error_ );
+        return false;
+    }
+    return true;
+}
+} //namespace detail
+
+void Mandu::SetList( const std::vector<Mandu*>& l ) {
+    Detach();
+    type_ = TYPE_LIST;
+    ::new (mandu_list_buf_) std::vector<Mandu*>(l);
+}
+
+void Mandu::SetList( std::vector<Mandu*>&& l ) {
+    Detach();
+    type_ = TYPE_LIST;
+    ::new (mandu_list_buf_) std::vector<Mandu*>(std::move(l));
+}
+
+void Mandu::SetRecord( const RecordLayout* layout , const std::vector<Mandu*>& fields ) {
+    assert( fields.size() == layout->field_size() );
+    Detach();
+    type_ = TYPE_RECORD;
+    ::new (record_.fields_buf) std::vector<Mandu*>(fields);
+    record_.layout = layout;
+}
+
+void Mandu::SetRecord( const RecordLayout* layout , std::vector<Mandu*>&& fields ) {
+    assert( fields.size() == layout->field_size() );
+    Detach();
+    type_ = TYPE_RECORD;
+    ::new (record_.fields_buf) std::vector<Mandu*>(std::move(fields));
+    record_.layout = layout;
+}
+
+void Mandu::SetListView( const Mandu& list , std::size_t begin , std::size_t end ) {
+    assert( begin <= end );
+    switch( list.type_ ) {
+        case TYPE_LIST:
+            {
+                // The list would be gone once this Mandu is detached
+                assert( &list != this );
+                assert( end <= list.ToList().size() );
+                Mandu* const* data = list.ToList().data() + begin;
+                Detach();
+                type_ = TYPE_LIST_VIEW;
+                column_.data = data;
+                column_.offsets = NULL;
+                column_.size = end - begin;
+                return;
+            }
+        case TYPE_LIST_VIEW:
+            {
+                // Read the window before Detach , the list may be this Mandu
+                assert( end <= list.column_.size );
+                Mandu* const* data = list.ToListView() + begin;
+                Detach();
+                type_ = TYPE_LIST_VIEW;
+                column_.data = data;
+                column_.offsets = NULL;
+                column_.size = end - begin;
+                return;
+            }
+        case TYPE_INT_ARRAY:
+            assert( end <= list.column_.size );
+            SetIntArray( list.ToIntArray() + begin , end - begin );
+            return;
+        case TYPE_STRING_COLUMN:
+            assert( end <= list.column_.size );
+            SetStringColumn( static_cast<const char*>(list.column_.data) ,
+                    list.column_.offsets + begin , end - begin );
+            return;
+        default:
+            assert( !"Only a list could be viewed!" );
+            return;
+    }
+}
+
+void Mandu::ReserveList( std::size_t capacity ) {
+    if( type_ != TYPE_LIST ) {
+        Detach();
+        type_ = TYPE_LIST;
+        ::new (mandu_list_buf_) std::vector<Mandu*>();
+    }
+    reinterpret_cast<std::vector<Mandu*>*>(mandu_list_buf_)->reserve(capacity);
+}
+
+void Mandu::AppendList( Mandu* element ) {
+    if( type_ != TYPE_LIST ) {
+        Detach();
+        type_ = TYPE_LIST;
+        ::new (mandu_list_buf_) std::vector<Mandu*>();
+    }
+    reinterpret_cast<std::vector<Mandu*>*>(mandu_list_buf_)->push_back(element);
+}
+
+void Mandu::Copy( const Mandu& mandu ) {
+    switch( mandu.type_ ) {
+        case TYPE_NONE:
+            Detach();
+            type_ = TYPE_NONE;
+            return;
+        case TYPE_NUMBER:
+            SetNumber(mandu.ToNumber());
+            return;
+        case TYPE_STRING:
+            SetString(mandu.ToString());
+            return;
+        case TYPE_LIST:
+            SetList( mandu.ToList() );
+            return;
+        case TYPE_INT_ARRAY:
+        case TYPE_STRING_COLUMN:
+        case TYPE_LIST_VIEW:
+            // The columnar list refers to the caller's memory , just share it
+            Detach();
+            type_ = mandu.type_;
+            column_ = mandu.column_;
+            return;
+        case TYPE_GENERATOR:
+            SetGenerator( mandu.ToGenerator() );
+            return;
+        case TYPE_RECORD:
+            SetRecord( mandu.ToRecordLayout() , mandu.ToRecordFields() );
+            return;
+        default:
+            UNREACHABLE(return);
+    }
+}
+
+std::string Mandu::ConvertToString() const {
+    switch( type_ ) {
+        case TYPE_NONE:
+            return std::string("<:null:>");
+        case TYPE_NUMBER:
+            return std::string( number_.text , number_.length );
+        case TYPE_LIST:
+        case TYPE_RECORD:
+            {
+                std::string output;
+                const std::vector<Mandu*>& l = type_ == TYPE_LIST ? ToList() : ToRecordFields();
+                for( std::vector<Mandu*>::const_iterator ib = l.begin() ; ib != l.end() ; ++ib ) {
+                    (*ib)->AppendString(&output);
+                }
+                return output;
+            }
+        case TYPE_LIST_VIEW:
+            {
+                std::string output;
+                for( std::size_t i = 0 ; i < column_.size ; ++i ) {
+                    ToListView()[i]->AppendString(&output);
+                }
+                return output;
+            }
+        case TYPE_STRING:
+            return ToString();
+        case TYPE_INT_ARRAY:
+            {
+                std::string output;
+                char buf[32];
+                const int64_t* array = ToIntArray();
+                for( std::size_t i = 0 ; i < column_.size ; ++i ) {
+                    int len = snprintf(buf,sizeof(buf),"%lld",static_cast<long long>(array[i]));
+                    output.append(buf,static_cast<std::size_t>(len));
                 }
+                return output;
             }
-        }
-        return ELEMENT_RANGE;
-    } else {
-        return ELEMENT_ATOMIC;
+        case TYPE_STRING_COLUMN:
+            {
+                // The strings are contiguous inside of the table
+                const char* data = static_cast<const char*>(column_.data);
+                return column_.size == 0 ? std::string() :
+                    std::string( data + column_.offsets[0] ,
+                                 column_.offsets[column_.size] - column_.offsets[0] );
+            }
+        case TYPE_GENERATOR:
+            {
+                std::string output;
+                Mandu element;
+                generator_->Rewind();
+                while( generator_->Next(&element) ) {
+                    element.AppendString(&output);
+                }
+                return output;
+            }
+        default:
+            UNREACHABLE(return std::string());
     }
+}
+
+// =======================================================
+// Template
+// =======================================================
+
+Template::Template():
+    data_(NULL),
+    size_(0),
+    loaded_(false),
+    minified_(false),
+    text_(),
+    map_(NULL),
+    map_size_(0),
+    pieces_(NULL),
+    piece_count_(0)
+{}
 
+Template::~Template() {
+    Unload();
 }
 
-bool Executor::ParseList( const std::string& section , std::vector<Mandu*>* outputs , std::string* error ) {
-    assert( tokenizer_.cur_lexme().token == TK_LSQR );
-    tokenizer_.Move();
-    // Quick test for empty list and then report error
-    if( tokenizer_.cur_lexme().token == TK_RSQR ) {
-        ReportError(error,"Empty list,what's the point!");
+bool Template::Load( const std::string& path , std::string* error ) {
+    Unload();
+
+    int fd = ::open( path.c_str() , O_RDONLY );
+    if( fd < 0 ) {
+        error->assign( ::strerror( errno ) );
         return false;
     }
 
-    Mandu* from = NULL;
-    Mandu* to = NULL;
+    struct stat st;
+    if( ::fstat( fd , &st ) != 0 ) {
+        error->assign( ::strerror( errno ) );
+        ::close(fd);
+        return false;
+    }
 
-    do {
-        from = from == NULL ? mandu_pool_.Grab() : from;
-        to = to == NULL ? mandu_pool_.Grab() : to;
-
-        int type = ParseListElement(section,from,to,outputs,error);
-        if( type == ELEMENT_FAIL ) {
-            mandu_pool_.Drop(from);
-            mandu_pool_.Drop(to);
-            goto fail;
-        } else {
-            switch(type) {
-                case ELEMENT_ATOMIC:
-                    outputs->push_back( from );
-                    from = to;
-                    to = NULL;
-                    break;
-                case ELEMENT_RANGE:
-                    {
-                        int from_count = from->ToNumber();
-                        int to_count = to->ToNumber();
-                        for( ; from_count < to_count ; ++from_count ) {
-                            outputs->push_back(
-                                    mandu_pool_.Grab(from_count));
-                        }
-                        mandu_pool_.Drop(from);
-                        mandu_pool_.Drop(to);
-                        from = to = NULL;
-                        break;
-                    }
-                case ELEMENT_LIST:
-                    break;
-                default:
-                    UNREACHABLE(return false);
-            }
-            if( tokenizer_.cur_lexme().token == TK_COMMA ) {
-                // Continue looping
-                tokenizer_.Move();
-                continue;
-            } else if( tokenizer_.cur_lexme().token == TK_RSQR ) {
-                tokenizer_.Move();
-                break;
-            } else {
-                ReportError(error,"Unexpected element in list");
-                return false;
-            }
+    // Empty file cannot be mapped , it is just an empty template
+    if( st.st_size > 0 ) {
+        void* addr = ::mmap( NULL , static_cast<std::size_t>(st.st_size) ,
+                PROT_READ , MAP_PRIVATE , fd , 0 );
+        if( addr == MAP_FAILED ) {
+            error->assign( ::strerror( errno ) );
+            ::close(fd);
+            return false;
         }
-    } while(true);
-    return true;
-fail:
-    for( std::vector<Mandu*>::iterator i = outputs->begin() ;  i != outputs->end() ; ++i ) {
-        mandu_pool_.Drop( *i );
+        map_ = static_cast<const char*>(addr);
+        map_size_ = static_cast<std::size_t>(st.st_size);
+        data_ = map_;
+        size_ = map_size_;
     }
-    outputs->clear();
-    return false;
+
+    // The mapping is still valid after the file descriptor is closed
+    ::close(fd);
+    loaded_ = true;
+
+    if( map_size_ >= sizeof(detail::kTemplateMagic) &&
+        memcmp( map_ , detail::kTemplateMagic , sizeof(detail::kTemplateMagic) ) == 0 &&
+        !LoadCompiled(error) ) {
+        Unload();
+        return false;
+    }
+    return true;
 }
 
-bool Executor::ExecuteListBody( const std::string& source, int position , int* offset ,
-        const std::vector<Mandu*>& list , std::vector<std::string>* output , std::string* error ) {
-    std::string dummy;
+bool Template::LoadCompiled( std::string* error ) {
+    using detail::TemplateHeader;
+    using detail::TemplatePiece;
 
-    for( std::vector<Mandu*>::const_iterator ib = list.begin() ; ib != list.end() ; ++ib ) {
-        output->push_back(dummy);
-        std::string* temp = &(output->back());
-        const Mandu* m = *ib;
-        if( m->type() == Mandu::TYPE_LIST ) {
-            // This is a list, just executing this list again
-            std::vector<std::string> list_output;
-            if(!ExecuteListBody(source,position,offset,
-                        m->ToList(),&list_output,error))
-                return false;
-            // Concatenate the string list into the temporary slots in output
-            Concatenate(list_output,temp);
+    if( map_size_ < sizeof(TemplateHeader) ) {
+        error->assign("Truncated template header!");
+        return false;
+    }
+    const TemplateHeader* header = reinterpret_cast<const TemplateHeader*>(map_);
+    if( header->byte_order != detail::kByteOrder ) {
+        error->assign("Template is compiled for another byte order!");
+        return false;
+    }
+    if( header->version != detail::kTemplateVersion ) {
+        error->assign("Unsupported template version!");
+        return false;
+    }
+
+    // Nothing in the file is trusted , all the offsets are checked once here
+    // so the cook could use them directly.
+    const uint64_t size = map_size_;
+    if( header->piece_offset % sizeof(uint64_t) != 0 ||
+        header->piece_offset > size ||
+        header->piece_count > (size - header->piece_offset) / sizeof(TemplatePiece) ||
+        header->text_offset > size ||
+        header->text_size > size - header->text_offset ) {
+        error->assign("Corrupted template header!");
+        return false;
+    }
+    const TemplatePiece* pieces = reinterpret_cast<const TemplatePiece*>(
+            map_ + header->piece_offset );
+    const char* text = map_ + header->text_offset;
+    uint64_t position = 0;
+    for( uint64_t i = 0 ; i < header->piece_count ; ++i ) {
+        const TemplatePiece& piece = pieces[i];
+        if( piece.offset < position || piece.offset > header->text_size ||
+            piece.length > header->text_size - piece.offset ||
+            ( piece.kind == TemplatePiece::PIECE_SEGMENT &&
+              ( piece.length < 2 || text[piece.offset] != '`' ||
+                text[piece.offset + piece.length - 1] != '`' ) ) ||
+            piece.kind > TemplatePiece::PIECE_SEGMENT ) {
+            error->assign("Corrupted template piece!");
+            return false;
+        }
+        position = piece.offset + piece.length;
+    }
+
+    data_ = text;
+    size_ = static_cast<std::size_t>(header->text_size);
+    pieces_ = pieces;
+    piece_count_ = static_cast<std::size_t>(header->piece_count);
+    return true;
+}
+
+namespace {
+// Split the top level of the text into pieces , the same way as Cook does.
+bool BuildPieces( const Source& text , std::vector<detail::TemplatePiece>* pieces ,
+        std::string* error ) {
+    using detail::TemplatePiece;
+    std::size_t start = 0;
+
+    for( std::size_t i = 0 ; i <= text.size() ; ++i ) {
+        bool escape = i+1 < text.size() && text.at(i) == '\\' && text.at(i+1) == '`';
+        bool segment = i < text.size() && text.at(i) == '`';
+        if( !escape && !segment && i < text.size() )
             continue;
-        } else {
-            if(!ExecuteBody( *m , source , position , offset , temp , error )) {
+
+        if( i > start ) {
+            TemplatePiece piece = { start , i - start , TemplatePiece::PIECE_LITERAL , 0 };
+            pieces->push_back(piece);
+        }
+        if( escape ) {
+            // Drop the backslash , the backtick starts the next run
+            start = ++i;
+        } else if( segment ) {
+            std::size_t end;
+            if( !SkipSegment( text , i+1 , &end ) ) {
+                std::ostringstream formatter;
+                formatter << "Unterminated segment at offset " << i << "!";
+                error->assign( formatter.str() );
                 return false;
             }
+            TemplatePiece piece = { i , end - i + 1 , TemplatePiece::PIECE_SEGMENT , 0 };
+            pieces->push_back(piece);
+            start = end + 1;
+            i = end;
         }
     }
     return true;
 }
 
-bool Executor::ExecuteList( const std::string& section , std::vector<std::string>* outputs , std::string* error ) {
-    assert( tokenizer_.cur_lexme().token == TK_LSQR );
-    std::vector<Mandu*> list;
-    if( !ParseList(section,&list,error) )
+bool WriteAll( int fd , const void* data , std::size_t size ) {
+    const char* ptr = static_cast<const char*>(data);
+    while( size > 0 ) {
+        ssize_t ret = ::write( fd , ptr , size );
+        if( ret < 0 ) {
+            if( errno == EINTR )
+                continue;
+            return false;
+        }
+        ptr += ret;
+        size -= static_cast<std::size_t>(ret);
+    }
+    return true;
+}
+}// namespace
+
+bool Template::Save( const std::string& path , std::string* error ) const {
+    using detail::TemplateHeader;
+    using detail::TemplatePiece;
+
+    std::vector<TemplatePiece> pieces;
+    if( !BuildPieces( Source(data_,size_) , &pieces , error ) )
         return false;
 
-    // Check wether we need to execute the body or just output the string here
-    if( tokenizer_.cur_lexme().token == TK_LBRA ) {
-        tokenizer_.Move();
-        int start_position = tokenizer_.position();
-        int end_position = -1;
+    TemplateHeader header;
+    memset( &header , 0 , sizeof(header) );
+    memcpy( header.magic , detail::kTemplateMagic , sizeof(header.magic) );
+    header.version = detail::kTemplateVersion;
+    header.byte_order = detail::kByteOrder;
+    header.piece_offset = sizeof(header);
+    header.piece_count = pieces.size();
+    header.text_offset = header.piece_offset + pieces.size() * sizeof(TemplatePiece);
+    header.text_size = size_;
+
+    // Write a temporary file and rename it , so a process never maps a half
+    // written template
+    std::string temporary( path + ".tmp" );
+    int fd = ::open( temporary.c_str() , O_WRONLY | O_CREAT | O_TRUNC , 0644 );
+    if( fd < 0 ) {
+        error->assign( ::strerror( errno ) );
+        return false;
+    }
+    if( !WriteAll( fd , &header , sizeof(header) ) ||
+        ( !pieces.empty() && !WriteAll( fd , pieces.data() , pieces.size() * sizeof(TemplatePiece) ) ) ||
+        !WriteAll( fd , data_ , size_ ) ) {
+        error->assign( ::strerror( errno ) );
+        ::close(fd);
+        ::unlink( temporary.c_str() );
+        return false;
+    }
+    if( ::close(fd) != 0 || ::rename( temporary.c_str() , path.c_str() ) != 0 ) {
+        error->assign( ::strerror( errno ) );
+        ::unlink( temporary.c_str() );
+        return false;
+    }
+    return true;
+}
 
-        if( !ExecuteListBody(tokenizer_.source(),start_position,
-                    &end_position,list,outputs,error) )
-            goto fail;
-        tokenizer_.Set(end_position);
-    } else {
-        // Just dump the list into the outptus string buffer is fine
-        for( std::vector<Mandu*>::iterator ib = list.begin() ; ib != list.end() ; ++ib ) {
-            outputs->push_back( (*ib)->ConvertToString() );
+void Template::Unload() {
+    if( map_ != NULL ) {
+        ::munmap( const_cast<char*>(map_) , map_size_ );
+    }
+    map_ = NULL;
+    map_size_ = 0;
+    pieces_ = NULL;
+    piece_count_ = 0;
+    data_ = NULL;
+    size_ = 0;
+    loaded_ = false;
+    minified_ = false;
+    text_.clear();
+}
+
+void Template::Minify() {
+    if( !loaded_ || minified_ )
+        return;
+    std::string text;
+    MinifyWhitespace( Source(data_,size_) , &text );
+    // The mapping is not needed anymore
+    Unload();
+    text_.swap(text);
+    data_ = text_.data();
+    size_ = text_.size();
+    loaded_ = true;
+    minified_ = true;
+}
+
+// =======================================================
+// TemplateStore
+// =======================================================
+
+const Template* TemplateStore::Load( const std::string& path , std::string* error ) {
+    std::vector<Entry>::iterator iter = std::lower_bound(
+            templates_.begin(), templates_.end(), path );
+    if( iter != templates_.end() && iter->path == path )
+        return iter->tpl;
+
+    Template* tpl = new Template();
+    if( !tpl->Load( path , error ) ) {
+        delete tpl;
+        return NULL;
+    }
+    if( minify_whitespace_ )
+        tpl->Minify();
+    Entry entry;
+    entry.path = path;
+    entry.tpl = tpl;
+    templates_.insert( iter , entry );
+    return tpl;
+}
+
+bool TemplateStore::Unload( const std::string& path ) {
+    std::vector<Entry>::iterator iter = std::lower_bound(
+            templates_.begin(), templates_.end(), path );
+    if( iter == templates_.end() || iter->path != path )
+        return false;
+    delete iter->tpl;
+    templates_.erase( iter );
+    return true;
+}
+
+void TemplateStore::Clear() {
+    for( std::vector<Entry>::iterator i = templates_.begin() ;
+            i != templates_.end() ; ++i ) {
+        delete i->tpl;
+    }
+    templates_.clear();
+}
+
+// =======================================================
+// ScatterOutput
+// =======================================================
+
+ScatterOutput::ScatterOutput():
+    slices_(),
+    size_(0),
+    blocks_(),
+    cur_block_(0),
+    block_used_(0),
+    written_slice_(0),
+    written_offset_(0)
+{}
+
+ScatterOutput::~ScatterOutput() {
+    for( std::vector<Block>::iterator i = blocks_.begin() ; i != blocks_.end() ; ++i ) {
+        free(i->data);
+    }
+}
+
+char* ScatterOutput::Reserve( std::size_t length ) {
+    if( cur_block_ < blocks_.size() &&
+        blocks_[cur_block_].capacity - block_used_ >= length ) {
+        char* ret = blocks_[cur_block_].data + block_used_;
+        block_used_ += length;
+        return ret;
+    }
+
+    // Move to the next block , the block is replaced if it is too small
+    std::size_t next = ( cur_block_ < blocks_.size() && block_used_ > 0 ) ?
+        cur_block_ + 1 : cur_block_;
+    std::size_t capacity = length > kScratchBlockSize ? length : kScratchBlockSize;
+
+    if( next == blocks_.size() ) {
+        Block block;
+        block.data = static_cast<char*>(malloc(capacity));
+        block.capacity = capacity;
+        blocks_.push_back(block);
+    } else if( blocks_[next].capacity < length ) {
+        free(blocks_[next].data);
+        blocks_[next].data = static_cast<char*>(malloc(capacity));
+        blocks_[next].capacity = capacity;
+    }
+    cur_block_ = next;
+    block_used_ = length;
+    return blocks_[next].data;
+}
+
+void ScatterOutput::Push( const char* str , std::size_t length ) {
+    size_ += length;
+    // Merge with the last slice if they are adjacent
+    if( !slices_.empty() ) {
+        Slice& last = slices_.back();
+        if( last.data + last.size == str ) {
+            last.size += length;
+            return;
+        }
+    }
+    Slice slice;
+    slice.data = str;
+    slice.size = length;
+    slices_.push_back(slice);
+}
+
+void ScatterOutput::Append( const char* str , std::size_t length ) {
+    if( length == 0 )
+        return;
+    char* buf = Reserve(length);
+    memcpy(buf,str,length);
+    Push(buf,length);
+}
+
+void ScatterOutput::AppendLiteral( const char* str , std::size_t length ) {
+    if( length == 0 )
+        return;
+    Push(str,length);
+}
+
+bool ScatterOutput::WriteTo( int fd , std::string* error ) {
+#ifdef IOV_MAX
+    static const std::size_t kMaxIoVec = IOV_MAX;
+#else
+    static const std::size_t kMaxIoVec = 1024;
+#endif // IOV_MAX
+    struct iovec iov[ kMaxIoVec < 1024 ? kMaxIoVec : 1024 ];
+    const std::size_t iov_cap = sizeof(iov)/sizeof(iov[0]);
+
+    while( written_slice_ < slices_.size() ) {
+        std::size_t count = 0;
+        for( std::size_t i = written_slice_ ;
+                i < slices_.size() && count < iov_cap ; ++i , ++count ) {
+            std::size_t offset = i == written_slice_ ? written_offset_ : 0;
+            iov[count].iov_base = const_cast<char*>(slices_[i].data + offset);
+            iov[count].iov_len = slices_[i].size - offset;
+        }
+
+        ssize_t ret = ::writev( fd , iov , static_cast<int>(count) );
+        if( ret < 0 ) {
+            if( errno == EINTR )
+                continue;
+            error->assign( ::strerror( errno ) );
+            return false;
+        }
+
+        // Advance the progress by the bytes written
+        std::size_t left = static_cast<std::size_t>(ret);
+        while( left > 0 ) {
+            std::size_t remain = slices_[written_slice_].size - written_offset_;
+            if( left < remain ) {
+                written_offset_ += left;
+                break;
+            }
+            left -= remain;
+            ++written_slice_;
+            written_offset_ = 0;
         }
     }
     return true;
+}
 
-fail:
-    for( std::vector<Mandu*>::iterator i = list.begin() ;  i != list.end() ; ++i ) {
-        mandu_pool_.Drop( *i );
+void ScatterOutput::AppendTo( std::string* output ) const {
+    output->reserve( output->size() + size_ );
+    for( std::vector<Slice>::const_iterator i = slices_.begin() ; i != slices_.end() ; ++i ) {
+        output->append( i->data , i->size );
     }
-    return false;
 }
 
-bool Executor::ExecuteAtomic( const std::string& section , std::vector<std::string>* outputs , std::string* error ) {
-    Mandu* atomic = mandu_pool_.Grab();
-    if( !ParseAtomic(section,atomic,error) )
-        goto fail;
+void ScatterOutput::Clear() {
+    slices_.clear();
+    size_ = 0;
+    cur_block_ = 0;
+    block_used_ = 0;
+    written_slice_ = 0;
+    written_offset_ = 0;
+}
+
+#ifdef MANDU_USE_ZLIB
+// =======================================================
+// DeflateCache
+// =======================================================
 
-    if( tokenizer_.cur_lexme().token == TK_LBRA ) {
-        tokenizer_.Move();
-        int start_position = tokenizer_.position();
-        int end_position = -1;
+namespace detail {
 
-        outputs->push_back(std::string());
-        std::string* temp = &(outputs->back());
-        if(!ExecuteBody(*atomic,tokenizer_.source(),start_position,
-                    &end_position,temp,error)) {
-            goto fail;
+// The blocks are found by the address and the size of the literal , the most
+// recently used block is at the front of the list
+struct DeflateCacheIndex {
+    typedef std::pair<const char*,std::size_t> Key;
+    typedef std::list<DeflateCache::Block> BlockList;
+
+    struct KeyHash {
+        std::size_t operator () ( const Key& key ) const {
+            return std::hash<const char*>()(key.first) ^ ( key.second * 0x9e3779b97f4a7c15ULL );
         }
-        mandu_pool_.Drop(atomic);
-        tokenizer_.Set(end_position);
-        return true;
+    };
+
+    BlockList blocks;
+    std::unordered_map<Key,BlockList::iterator,KeyHash> index;
+};
+
+}// namespace detail
+
+DeflateCache::DeflateCache( int level , std::size_t min_size , std::size_t max_bytes ):
+    index_( new detail::DeflateCacheIndex() ),
+    stream_( NewDeflateStream(level) ),
+    min_size_( min_size ),
+    max_bytes_( max_bytes ),
+    bytes_(0)
+{}
+
+DeflateCache::~DeflateCache() {
+    delete index_;
+    DeleteDeflateStream(stream_);
+}
+
+std::size_t DeflateCache::size() const {
+    return index_->blocks.size();
+}
+
+void DeflateCache::Clear() {
+    index_->index.clear();
+    index_->blocks.clear();
+    bytes_ = 0;
+}
+
+const DeflateCache::Block* DeflateCache::Get( const char* data , std::size_t size ,
+        unsigned long crc ) {
+    if( stream_ == NULL )
+        return NULL;
+
+    detail::DeflateCacheIndex::BlockList& blocks = index_->blocks;
+    const detail::DeflateCacheIndex::Key key(data,size);
+    std::unordered_map<detail::DeflateCacheIndex::Key,
+        detail::DeflateCacheIndex::BlockList::iterator,
+        detail::DeflateCacheIndex::KeyHash>::iterator iter = index_->index.find(key);
+    Block* block;
+    if( iter != index_->index.end() ) {
+        blocks.splice( blocks.begin() , blocks , iter->second );
+        block = &blocks.front();
+        if( block->crc == crc )
+            return block;
+        // The address is reused by another text
+        bytes_ -= block->deflated.size();
+        block->deflated.clear();
     } else {
-        outputs->push_back( atomic->ConvertToString() );
-        mandu_pool_.Drop(atomic);
-        return true;
+        blocks.push_front( Block() );
+        block = &blocks.front();
+        block->data = data;
+        block->size = size;
+        index_->index[key] = blocks.begin();
     }
 
-fail:
-    mandu_pool_.Drop(atomic);
-    return false;
+    // Each block is compressed alone and ends with a full flush , so it has
+    // no back reference outside of itself and could be spliced anywhere.
+    block->crc = crc;
+    deflateReset(stream_);
+    RunDeflate( stream_ , data , size , Z_FULL_FLUSH , &block->deflated );
+    bytes_ += block->deflated.size();
+
+    // Drop the least recently used blocks , the new one is always kept
+    while( bytes_ > max_bytes_ && blocks.size() > 1 ) {
+        const Block& last = blocks.back();
+        bytes_ -= last.deflated.size();
+        index_->index.erase( detail::DeflateCacheIndex::Key(last.data,last.size) );
+        blocks.pop_back();
+    }
+    return block;
 }
 
-bool Executor::ExecuteBody( const Mandu& dollar_sign , const std::string& source , int position ,
-        int* offset , std::string* output , std::string* error ) {
-    for( std::size_t i = position ; i < source.size() ; ++i ) {
-        int cha = source.at(i);
-        if( cha == '\\' ) {
-            if( IsBodyEscapeChar(i+1) ) {
-                // It is the escape character we need to skip here
-                output->push_back( tokenizer_.source().at(i+1) );
-                ++i;
-            } else {
-                output->push_back(cha);
-            }
-        } else {
-            if( cha == '$' ) {
-                // Do the substitution here
-                output->append(dollar_sign.ConvertToString());
-            } else if( cha == '`' ) {
-                // Call Cook again however we need to save the current
-                // tokenizer_ context to resume the usage later on
-                Tokenizer tk(tokenizer_);
-                int ret = CookSegment( tokenizer_.source() , i , output , error );
-                if( ret < 0 )
-                    return false;
-                else {
-                    tokenizer_ = tk;
-                }
-                i = static_cast<std::size_t>(ret);
-            } else {
-                // End of the stream here
-                if( cha == '}' ) {
-                    // End of the body expression here. Just return here
-                    *offset = i+1;
-                    return true;
-                }
-                output->push_back(cha);
-            }
+// =======================================================
+// GzipOutput
+// =======================================================
+
+GzipOutput::GzipOutput( DeflateCache* cache , int level ):
+    cache_( cache ),
+    stream_( NewDeflateStream(level) ),
+    data_(),
+    crc_(0),
+    size_(0),
+    pending_(false),
+    finished_(false)
+{
+    Clear();
+}
+
+GzipOutput::~GzipOutput() {
+    DeleteDeflateStream(stream_);
+}
+
+void GzipOutput::Clear() {
+    // Header without name and time , OS is unix
+    static const char kHeader[] = { '\x1f' , '\x8b' , 8 , 0 , 0 , 0 , 0 , 0 , 0 , 3 };
+
+    data_.assign( kHeader , sizeof(kHeader) );
+    crc_ = crc32(0,Z_NULL,0);
+    size_ = 0;
+    pending_ = false;
+    finished_ = false;
+    if( stream_ != NULL )
+        deflateReset(stream_);
+}
+
+void GzipOutput::Flush( int flush ) {
+    RunDeflate( stream_ , NULL , 0 , flush , &data_ );
+}
+
+void GzipOutput::Append( const char* str , std::size_t length ) {
+    assert( !finished_ );
+    if( length == 0 || stream_ == NULL )
+        return;
+    crc_ = crc32_z( crc_ , reinterpret_cast<const Bytef*>(str) , length );
+    size_ += length;
+    RunDeflate( stream_ , str , length , Z_NO_FLUSH , &data_ );
+    pending_ = true;
+}
+
+void GzipOutput::AppendLiteral( const char* str , std::size_t length ) {
+    if( cache_ == NULL || length < cache_->min_size() ) {
+        Append(str,length);
+        return;
+    }
+    assert( !finished_ );
+
+    unsigned long crc = crc32_z( 0 , reinterpret_cast<const Bytef*>(str) , length );
+    const DeflateCache::Block* block = cache_->Get(str,length,crc);
+    if( block == NULL || stream_ == NULL ) {
+        Append(str,length);
+        return;
+    }
+
+    // A full flush aligns the stream to a byte boundary and drops its history ,
+    // so the following blocks never refer to the bytes of the spliced block.
+    if( pending_ ) {
+        Flush(Z_FULL_FLUSH);
+        pending_ = false;
+    }
+    data_.append( block->deflated );
+    crc_ = crc32_combine( crc_ , crc , static_cast<z_off_t>(length) );
+    size_ += length;
+}
+
+void GzipOutput::Finish() {
+    if( finished_ || stream_ == NULL )
+        return;
+    Flush(Z_FINISH);
+
+    // Trailer is the crc32 and the size modulo 2^32 , both little endian
+    unsigned long values[2] = { crc_ , static_cast<unsigned long>(size_ & 0xffffffffUL) };
+    for( int i = 0 ; i < 2 ; ++i ) {
+        for( int k = 0 ; k < 4 ; ++k ) {
+            data_.push_back( static_cast<char>( (values[i] >> (8*k)) & 0xff ) );
         }
     }
-    // If we reach here , it means we meet an unexceptional EOF of the stream
-    ReportError(error,"Unexpected end of the stream!Expecting \"}\"");
-    return false;
+    finished_ = true;
+}
+
+void GzipOutput::Take( std::string* output ) {
+    output->append(data_);
+    data_.clear();
+}
+#endif // MANDU_USE_ZLIB
+
+// =======================================================
+// Scope
+// =======================================================
+
+Scope::Scope():
+    impl_( new detail::ScopeImpl() )
+{}
+
+Scope::~Scope() {
+    delete impl_;
+}
+
+Mandu* Scope::NewMandu( const std::string& section_key , const std::string& key ) {
+    return impl_->NewMandu( section_key , key );
+}
+
+Mandu* Scope::NewMandu( const std::string& key ) {
+    return impl_->NewMandu( key );
+}
+
+Mandu* Scope::NewMandu() {
+    return impl_->NewMandu();
+}
+
+void Scope::Freeze() {
+    impl_->Freeze();
+}
+
+bool Scope::IsFrozen() const {
+    return impl_->frozen();
+}
+
+// =======================================================
+// RecordLayout
+// =======================================================
+
+RecordLayout::RecordLayout( const std::vector<std::string>& fields ):
+    names_( fields ),
+    symbols_(),
+    hash_(0)
+{
+    Fingerprint fingerprint;
+    for( std::size_t i = 0 ; i < names_.size() ; ++i ) {
+        symbols_.push_back( std::make_pair(
+                    detail::SymbolTable::Instance()->Intern(names_[i]) , static_cast<int>(i) ) );
+        fingerprint.Mix( static_cast<uint64_t>(names_[i].size()) );
+        fingerprint.Mix( names_[i].data() , names_[i].size() );
+    }
+    std::sort( symbols_.begin() , symbols_.end() );
+    hash_ = fingerprint.hash();
 }
 
-bool Executor::Execute( std::vector<std::string>* output , std::string* error ) {
-    Mandu* section_key = mandu_pool_.Grab();
-    std::string dummy;
-
-    if( tokenizer_.cur_lexme().token == TK_SECTION_START ) {
-        // Parsing the section key here
-        tokenizer_.Move();
-        if( tokenizer_.cur_lexme().token != TK_STRING ) {
-            ReportError(error,"Expect section key!");
-            goto fail;
-        }
-        if( !ParseString( section_key , error ) )
-            goto fail;
+int RecordLayout::FindField( const std::string& name ) const {
+    return FindField( name.data() , name.size() );
+}
 
-        // Now we have got our section key , just start the execution here
-        if( tokenizer_.cur_lexme().token == TK_END ) {
-            ReportError(error,"Unexpected end of the stream with empty section body!");
-            goto fail;
-        }
+int RecordLayout::FindField( const char* name , std::size_t length ) const {
+    // The names are interned , a name that is not a symbol is no field
+    int symbol = detail::SymbolTable::Instance()->Find(name,length);
+    if( symbol == detail::SymbolTable::kNoSymbol )
+        return -1;
+    std::vector<std::pair<int,int> >::const_iterator iter = std::lower_bound(
+            symbols_.begin() , symbols_.end() , std::make_pair(symbol,-1) );
+    if( iter == symbols_.end() || iter->first != symbol )
+        return -1;
+    return iter->second;
+}
 
-        // Now just check whether such section key is existed or not
-        if( !IsSectionEnabled(section_key->ToString()) ) {
-            SectionSkipper skipper(
-                    tokenizer_.source(), tokenizer_.position() );
-            int ret = skipper.Skip(error);
-            if( ret < 0 ) {
-                // We have met an error just return here
-                goto fail;
-            } else {
-                tokenizer_.Set(ret);
-                // Now we have correctly skipped the body , just return
-                return true;
-            }
-        }
-    }
+// =======================================================
+// FragmentCache
+// =======================================================
 
-    // Start to run the body here
-    do {
-        switch( tokenizer_.cur_lexme().token ) {
-            case TK_NUMBER:
-            case TK_STRING:
-            case TK_VARIABLE:
-                if( !ExecuteAtomic(section_key->type() == Mandu::TYPE_NONE ?
-                            dummy : section_key->ToString() , output, error)) {
-                    goto fail;
-                }
-                break;
-            case TK_LSQR:
-                if( !ExecuteList(section_key->type() == Mandu::TYPE_NONE ?
-                            dummy : section_key->ToString() , output, error)) {
-                    goto fail;
-                }
-                break;
-            default:
-                return true;
-        }
-        // Now check whether we can exit the loop or not
-        switch( tokenizer_.cur_lexme().token ) {
-            case TK_END:
-                return true;
-            case TK_SECTION_END:
-                tokenizer_.Move();
-                return true;
-            default:
-                break;
-        }
-    } while(true);
+FragmentCache::FragmentCache( std::size_t max_bytes ):
+    impl_( new detail::FragmentCacheImpl(max_bytes) )
+{}
 
-fail:
-    mandu_pool_.Drop(section_key);
-    return false;
+FragmentCache::~FragmentCache() {
+    delete impl_;
 }
 
-void Executor::Concatenate( const std::vector<std::string>& input, std::string* output ) {
-    // 1. First loop to checkout how many memory is needed for string
-    std::size_t len = 0;
-    for( std::vector<std::string>::const_iterator ib = input.begin() ;
-            ib != input.end() ; ++ib ) {
-        len += ib->size();
-    }
+void FragmentCache::Clear() {
+    impl_->Clear();
+}
 
-    output->reserve(len+output->size());
-    for( std::vector<std::string>::const_iterator ib = input.begin() ;
-            ib != input.end() ; ++ib ) {
-        output->append( *ib );
-    }
+std::size_t FragmentCache::size() const {
+    return impl_->size();
 }
 
-bool Executor::DoExecute( std::string* output, std::string* error ) {
-    std::vector<std::string> ol;
-    do {
-        if( !Execute(&ol,error) )
-            return false;
-        switch( tokenizer_.cur_lexme().token ) {
-            case TK_STRING:
-            case TK_NUMBER:
-            case TK_VARIABLE:
-            case TK_LSQR:
-            case TK_SECTION_START:
-                break;
-            case TK_END:
-                goto done;
-            default:
-                // error comes here now
-                ReportError(error,"Unexpected token here!");
-                return false;
-        }
-    } while( true );
+uint64_t FragmentCache::hit_count() const {
+    return impl_->hit_count();
+}
 
-done:
-    // Stringtify all the input inside of the string table
-    Concatenate(ol,output);
-    return true;
+uint64_t FragmentCache::miss_count() const {
+    return impl_->miss_count();
 }
-} //namespace detail
 
-void Mandu::SetList( const std::vector<Mandu*>& l ) {
-    Detach();
-    type_ = TYPE_LIST;
-    std::vector<Mandu*>* out = ::new (mandu_list_buf_) std::vector<Mandu*>();
-    for( std::vector<Mandu*>::const_iterator i = l.begin() ; i != l.end() ; ++i ) {
-        out->push_back( *i );
-    }
+// =======================================================
+// ScopePublisher
+// =======================================================
+
+ScopePublisher::ScopePublisher():
+    impl_( new detail::ScopePublisherImpl() )
+{}
+
+ScopePublisher::~ScopePublisher() {
+    delete impl_;
 }
 
-void Mandu::Copy( const Mandu& mandu ) {
-    switch( mandu.type_ ) {
-        case TYPE_NONE:
-            Detach();
-            type_ = TYPE_NONE;
-            return;
-        case TYPE_NUMBER:
-            SetNumber(mandu.ToNumber());
-            return;
-        case TYPE_STRING:
-            SetString(mandu.ToString());
-            return;
-        case TYPE_LIST:
-            SetList( mandu.ToList() );
-            return;
-        default:
-            UNREACHABLE(return);
-    }
+void ScopePublisher::Publish( Scope* scope ) {
+    assert( scope != NULL && scope->IsFrozen() );
+    impl_->Publish( scope , scope->impl_ );
 }
 
-std::string Mandu::ConvertToString() const {
-    switch( type_ ) {
-        case TYPE_NONE:
-            return std::string("<:null:>");
-        case TYPE_NUMBER:
-            {
-                char buf[256];
-                sprintf(buf,"%d",ToNumber());
-                return std::string(buf);
-            }
-        case TYPE_LIST:
-            {
-                std::string output;
-                const std::vector<Mandu*>& l = ToList();
-                for( std::vector<Mandu*>::const_iterator ib = l.begin() ; ib != l.end() ; ++ib ) {
-                    (*ib)->AppendString(&output);
-                }
-                return output;
-            }
-        case TYPE_STRING:
-            return ToString();
-        default:
-            UNREACHABLE(return std::string());
-    }
+uint64_t ScopePublisher::version() const {
+    return impl_->version();
 }
 
 // =======================================================
@@ -1480,6 +5964,55 @@ void SoupMaker::Clear() {
     impl_->Clear();
 }
 
+void SoupMaker::SetSizingLimits( std::size_t max_output_reserve , std::size_t max_pool_page ) {
+    impl_->SetSizingLimits( max_output_reserve , max_pool_page );
+}
+
+void SoupMaker::ReleaseFreeMemory() {
+    detail::PageCache::Trim();
+}
+
+void SoupMaker::EnableProfiling( bool enable ) {
+    impl_->EnableProfiling(enable);
+}
+
+bool SoupMaker::DumpProfile( int metric , std::string* output ) const {
+    if( impl_->profiler() == NULL )
+        return false;
+    impl_->profiler()->Dump(metric,output);
+    return true;
+}
+
+void SoupMaker::ResetProfile() {
+    if( impl_->profiler() != NULL )
+        impl_->profiler()->Reset();
+}
+
+void SoupMaker::SetBaseScope( const Scope* scope ) {
+    impl_->SetBaseScope( scope == NULL ? NULL : scope->impl_ );
+}
+
+void SoupMaker::SetScopePublisher( ScopePublisher* publisher ) {
+    impl_->SetScopePublisher( publisher == NULL ? NULL : publisher->impl_ );
+}
+
+void SoupMaker::SetFragmentCache( FragmentCache* cache ) {
+    impl_->SetFragmentCache( cache == NULL ? NULL : cache->impl_ );
+}
+
+void SoupMaker::SetParallelSegments( std::size_t threads , std::size_t min_segments ) {
+    impl_->SetParallelSegments( threads , min_segments );
+}
+
+bool SoupMaker::RegisterPartial( const std::string& name , const std::string& text ,
+        std::string* error ) {
+    return impl_->RegisterPartial( name , text , error );
+}
+
+bool SoupMaker::RemovePartial( const std::string& name ) {
+    return impl_->RemovePartial( name );
+}
+
 Mandu* SoupMaker::NewMandu( const std::string& section_key , const std::string& key ) {
     return impl_->NewMandu( section_key , key );
 }
@@ -1492,8 +6025,283 @@ Mandu* SoupMaker::NewMandu() {
     return impl_->NewMandu();
 }
 
+void SoupMaker::BindProvider( const std::string& section_key , const std::string& key ,
+        VariableProvider* provider , bool memoize ) {
+    impl_->BindProvider( section_key , key , provider , memoize );
+}
+
+void SoupMaker::BindProvider( const std::string& key , VariableProvider* provider , bool memoize ) {
+    impl_->BindProvider( key , provider , memoize );
+}
+
+void SoupMaker::SetMinifyWhitespace( bool minify ) {
+    impl_->set_minify_whitespace(minify);
+}
+
 bool SoupMaker::Cook( const std::string& text , std::string* output , std::string* error ) {
-    return impl_->Cook( text,output,error );
+    return impl_->Cook( impl_->Prepare(Source(text)),output,error );
+}
+
+bool SoupMaker::Cook( const Template& tpl , std::string* output , std::string* error ) {
+    return impl_->Cook( Source(tpl.data(),tpl.size()),output,error,tpl.pieces_,tpl.piece_count_ );
+}
+
+bool SoupMaker::Cook( const std::string& text , ScatterOutput* output , std::string* error ) {
+    if( !impl_->minify_whitespace() )
+        return impl_->Cook( Source(text),output,error );
+
+    // The minified copy belongs to the maker and is reused by the next
+    // cook , so the literal text is copied into the output
+    output->Clear();
+    ScatterSink sink(output,true);
+    return impl_->Cook( impl_->Prepare(Source(text)),&sink,error );
+}
+
+bool SoupMaker::Cook( const Template& tpl , ScatterOutput* output , std::string* error ) {
+    return impl_->Cook( Source(tpl.data(),tpl.size()),output,error,tpl.pieces_,tpl.piece_count_ );
+}
+
+#ifdef MANDU_USE_ZLIB
+bool SoupMaker::Cook( const std::string& text , GzipOutput* output , std::string* error ) {
+    output->Clear();
+    GzipSink sink(output);
+    if( !impl_->Cook( impl_->Prepare(Source(text)),&sink,error ) )
+        return false;
+    output->Finish();
+    return true;
+}
+
+bool SoupMaker::Cook( const Template& tpl , GzipOutput* output , std::string* error ) {
+    output->Clear();
+    GzipSink sink(output);
+    if( !impl_->Cook( Source(tpl.data(),tpl.size()),&sink,error,tpl.pieces_,tpl.piece_count_ ) )
+        return false;
+    output->Finish();
+    return true;
+}
+#endif // MANDU_USE_ZLIB
+
+bool SoupMaker::CookFile( const std::string& path , std::string* output , std::string* error ) {
+    Template tpl;
+    if( !tpl.Load( path , error ) )
+        return false;
+    // The template only lives for this cook , minify it in place
+    if( impl_->minify_whitespace() )
+        tpl.Minify();
+    return impl_->Cook( Source(tpl.data(),tpl.size()),output,error );
+}
+
+// =======================================================
+// RenderCursor
+// =======================================================
+
+RenderCursor::RenderCursor( SoupMaker* maker , const std::string& text , std::size_t stack_size ):
+    impl_( new detail::CursorImpl( maker->impl_ , maker->impl_->Prepare(Source(text)) , stack_size ) )
+{}
+
+RenderCursor::RenderCursor( SoupMaker* maker , const Template& tpl , std::size_t stack_size ):
+    impl_( new detail::CursorImpl( maker->impl_ , Source(tpl.data(),tpl.size()) , stack_size ,
+                tpl.pieces_ , tpl.piece_count_ ) )
+{}
+
+RenderCursor::~RenderCursor() {
+    delete impl_;
+}
+
+bool RenderCursor::Next( char* buffer , std::size_t capacity , std::size_t* length , std::string* error ) {
+    return impl_->Next( buffer , capacity , length , error );
+}
+
+bool RenderCursor::IsDone() const {
+    return impl_->IsDone();
+}
+
+// =======================================================
+// BatchRenderer
+// =======================================================
+
+namespace detail {
+
+// Each worker has its own queue. The owner takes from the front and the thieves
+// take from the back , a queue is only locked for the push or the pop itself.
+class BatchRendererImpl {
+public:
+    explicit BatchRendererImpl( std::size_t threads ):
+        next_(0),
+        queued_(0),
+        pending_(0),
+        stop_( false )
+    {
+        if( threads == 0 )
+            threads = std::thread::hardware_concurrency();
+        if( threads == 0 )
+            threads = 1;
+        workers_.reserve(threads);
+        for( std::size_t i = 0 ; i < threads ; ++i ) {
+            workers_.push_back( new Worker() );
+        }
+        for( std::size_t i = 0 ; i < threads ; ++i ) {
+            workers_[i]->thread = std::thread( &BatchRendererImpl::Run , this , i );
+        }
+    }
+
+    ~BatchRendererImpl() {
+        Wait();
+        {
+            std::lock_guard<std::mutex> guard(mutex_);
+            stop_ = true;
+        }
+        wake_.notify_all();
+        // A worker could still be looking into the queue of another one
+        for( std::size_t i = 0 ; i < workers_.size() ; ++i ) {
+            workers_[i]->thread.join();
+        }
+        for( std::size_t i = 0 ; i < workers_.size() ; ++i ) {
+            delete workers_[i];
+        }
+    }
+
+    void Submit( const Template* tpl , const std::string* text , BatchJob* job ) {
+        Job j = { tpl , text , job };
+        pending_.fetch_add(1);
+        Worker* w = workers_[ next_.fetch_add(1) % workers_.size() ];
+        {
+            std::lock_guard<std::mutex> guard(w->mutex);
+            w->queue.push_back(j);
+        }
+        queued_.fetch_add(1);
+        // Taking the lock makes sure a worker that is about to sleep sees
+        // the job or gets the notification
+        {
+            std::lock_guard<std::mutex> guard(mutex_);
+        }
+        wake_.notify_one();
+    }
+
+    void Wait() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while( pending_.load() != 0 )
+            done_.wait(lock);
+    }
+
+    std::size_t thread_size() const {
+        return workers_.size();
+    }
+
+private:
+    struct Job {
+        const Template* tpl;
+        const std::string* text;
+        BatchJob* job;
+    };
+
+    struct Worker {
+        std::mutex mutex;
+        std::deque<Job> queue;
+        SoupMaker maker;
+        std::string output;
+        std::string error;
+        std::thread thread;
+    };
+
+    bool Take( std::size_t index , Job* job ) {
+        // Own queue first
+        {
+            Worker* w = workers_[index];
+            std::lock_guard<std::mutex> guard(w->mutex);
+            if( !w->queue.empty() ) {
+                *job = w->queue.front();
+                w->queue.pop_front();
+                queued_.fetch_sub(1);
+                return true;
+            }
+        }
+        // Steal from the others
+        for( std::size_t i = 1 ; i < workers_.size() ; ++i ) {
+            Worker* w = workers_[ (index+i) % workers_.size() ];
+            std::lock_guard<std::mutex> guard(w->mutex);
+            if( !w->queue.empty() ) {
+                *job = w->queue.back();
+                w->queue.pop_back();
+                queued_.fetch_sub(1);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void Execute( Worker* w , const Job& job ) {
+        // Any worker may run the next job , so nothing the previous one set
+        // up is kept
+        w->maker.impl_->Reset();
+        w->output.clear();
+        w->error.clear();
+        bool ok = job.job->Bind( &w->maker , &w->error );
+        if( ok ) {
+            ok = job.tpl != NULL ? w->maker.Cook( *job.tpl , &w->output , &w->error ) :
+                                   w->maker.Cook( *job.text , &w->output , &w->error );
+        }
+        job.job->Done( ok , &w->output , w->error );
+    }
+
+    void Run( std::size_t index ) {
+        Worker* w = workers_[index];
+        for( ;; ) {
+            Job job;
+            if( Take(index,&job) ) {
+                Execute(w,job);
+                if( pending_.fetch_sub(1) == 1 ) {
+                    std::lock_guard<std::mutex> guard(mutex_);
+                    done_.notify_all();
+                }
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(mutex_);
+            if( queued_.load() != 0 )
+                continue;
+            if( stop_ )
+                return;
+            wake_.wait(lock);
+        }
+    }
+
+    std::vector<Worker*> workers_;
+    std::atomic<std::size_t> next_;
+    // Jobs inside of the queues
+    std::atomic<std::size_t> queued_;
+    // Jobs that are not done yet
+    std::atomic<std::size_t> pending_;
+    bool stop_;
+    // Protects stop_ and the sleeping
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::condition_variable done_;
+};
+
+}// namespace detail
+
+BatchRenderer::BatchRenderer( std::size_t threads ):
+    impl_( new detail::BatchRendererImpl(threads) )
+{}
+
+BatchRenderer::~BatchRenderer() {
+    delete impl_;
+}
+
+void BatchRenderer::Submit( const Template* tpl , BatchJob* job ) {
+    impl_->Submit( tpl , NULL , job );
+}
+
+void BatchRenderer::Submit( const std::string* text , BatchJob* job ) {
+    impl_->Submit( NULL , text , job );
+}
+
+void BatchRenderer::Wait() {
+    impl_->Wait();
+}
+
+std::size_t BatchRenderer::thread_size() const {
+    return impl_->thread_size();
 }
 }// namespace mandu
 
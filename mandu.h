@@ -2,25 +2,60 @@
 #define MANDU_H_
 
 #include <cstddef>
+#include <cstdint>
 #include <string>
 #include <vector>
+#include <utility>
 #include <cassert>
 
 // Mandu
 // A very tiny C++ text template engine. Its goal is to provide a
 // small yet powerful embeded C++ template engine for task like HTML
-// template processing.
+// template processing. It requires C++11.
+
+#ifdef MANDU_USE_ZLIB
+// zlib stream , see GzipOutput
+struct z_stream_s;
+#endif // MANDU_USE_ZLIB
 
 namespace mandu {
 namespace detail {
 // Implementator for the SoupMaker
 class Executor;
+// Implementator for the RenderCursor
+class CursorImpl;
+// Implementator for the Scope
+class ScopeImpl;
+// Implementator for the ScopePublisher
+class ScopePublisherImpl;
+// Implementator for the BatchRenderer
+class BatchRendererImpl;
+// Implementator for the FragmentCache
+class FragmentCacheImpl;
+// Index of a compiled template
+struct TemplatePiece;
+// Blocks of a DeflateCache
+struct DeflateCacheIndex;
 // Zone Allocator
 template< typename T > class ZoneAllocator;
 }// namespace detail
 
 class Mandu;
+class RecordLayout;
 class SoupMaker;
+class VariableProvider;
+class ListGenerator;
+class Scope;
+class ScopePublisher;
+class FragmentCache;
+class Template;
+class TemplateStore;
+class ScatterOutput;
+#ifdef MANDU_USE_ZLIB
+class DeflateCache;
+class GzipOutput;
+#endif // MANDU_USE_ZLIB
+class RenderCursor;
 
 class Mandu {
 public:
@@ -29,7 +64,16 @@ public:
         TYPE_NONE,
         TYPE_STRING,
         TYPE_NUMBER,
-        TYPE_LIST
+        TYPE_LIST,
+        // Columnar lists , the elements live inside of the caller's memory
+        TYPE_INT_ARRAY,
+        TYPE_STRING_COLUMN,
+        // Streaming list , the elements are pulled one by one
+        TYPE_GENERATOR,
+        // Fixed set of named fields , eg a table row
+        TYPE_RECORD,
+        // Window of another list , the elements are not copied
+        TYPE_LIST_VIEW
     };
 
     ~Mandu() {
@@ -44,7 +88,7 @@ public:
 
     int ToNumber() const {
         assert( type() == TYPE_NUMBER );
-        return number_;
+        return number_.value;
     }
 
     const std::vector<Mandu*>& ToList() const {
@@ -53,6 +97,49 @@ public:
             const std::vector<Mandu*>*>( mandu_list_buf_ );
     }
 
+    const int64_t* ToIntArray() const {
+        assert( type() == TYPE_INT_ARRAY );
+        return static_cast<const int64_t*>(column_.data);
+    }
+
+    // Element count of a columnar list or a list view
+    std::size_t ColumnSize() const {
+        assert( type() == TYPE_INT_ARRAY || type() == TYPE_STRING_COLUMN ||
+                type() == TYPE_LIST_VIEW );
+        return column_.size;
+    }
+
+    // The elements of a list view , there are ColumnSize of them
+    Mandu* const* ToListView() const {
+        assert( type() == TYPE_LIST_VIEW );
+        return static_cast<Mandu* const*>(column_.data);
+    }
+
+    // The index-th string of a string column , its length is stored in length
+    const char* ColumnString( std::size_t index , std::size_t* length ) const {
+        assert( type() == TYPE_STRING_COLUMN );
+        assert( index < column_.size );
+        *length = column_.offsets[index+1] - column_.offsets[index];
+        return static_cast<const char*>(column_.data) + column_.offsets[index];
+    }
+
+    ListGenerator* ToGenerator() const {
+        assert( type() == TYPE_GENERATOR );
+        return generator_;
+    }
+
+    const RecordLayout* ToRecordLayout() const {
+        assert( type() == TYPE_RECORD );
+        return record_.layout;
+    }
+
+    // The fields in the order of the layout
+    const std::vector<Mandu*>& ToRecordFields() const {
+        assert( type() == TYPE_RECORD );
+        return *reinterpret_cast<
+            const std::vector<Mandu*>*>( record_.fields_buf );
+    }
+
     std::string ConvertToString() const;
 
     void SetString( const std::string& str ) {
@@ -61,14 +148,98 @@ public:
         ::new (string_buf_) std::string(str);
     }
 
+    // Take over the string , no copy is made
+    void SetString( std::string&& str ) {
+        Detach();
+        type_ = TYPE_STRING;
+        ::new (string_buf_) std::string(std::move(str));
+    }
+
+    // Copy the buffer straight into the Mandu without a temporary string
+    void SetString( const char* str , std::size_t length ) {
+        Detach();
+        type_ = TYPE_STRING;
+        ::new (string_buf_) std::string(str,length);
+    }
+
+    // The decimal text of the number is made here once , a substitution
+    // just copies it
     void SetNumber( int number ) {
         Detach();
         type_ = TYPE_NUMBER;
-        number_ = number;
+        number_.value = number;
+        char buf[sizeof(number_.text)];
+        char* p = buf + sizeof(buf);
+        unsigned int n = number < 0 ? 0u - static_cast<unsigned int>(number) :
+                                      static_cast<unsigned int>(number);
+        do {
+            *--p = static_cast<char>('0' + n % 10);
+            n /= 10;
+        } while( n != 0 );
+        if( number < 0 )
+            *--p = '-';
+        number_.length = static_cast<unsigned char>( buf + sizeof(buf) - p );
+        for( std::size_t i = 0 ; i < number_.length ; ++i )
+            number_.text[i] = p[i];
+    }
+
+    // Bind an int64 array owned by the caller as a list. No element is copied,
+    // the array must be kept alive and unchanged until the cook is done.
+    void SetIntArray( const int64_t* array , std::size_t size ) {
+        Detach();
+        type_ = TYPE_INT_ARRAY;
+        column_.data = array;
+        column_.offsets = NULL;
+        column_.size = size;
+    }
+
+    // Bind a string table owned by the caller as a list. The index-th string
+    // is data[offsets[index]] to data[offsets[index+1]] , so offsets has size+1
+    // entries. Like SetIntArray , nothing is copied.
+    void SetStringColumn( const char* data , const std::size_t* offsets , std::size_t size ) {
+        Detach();
+        type_ = TYPE_STRING_COLUMN;
+        column_.data = data;
+        column_.offsets = offsets;
+        column_.size = size;
     }
 
     void SetList( const std::vector<Mandu*>& list );
 
+    // Bind a generator owned by the caller as a list. The elements are pulled
+    // one at a time while the list is iterated , nothing is materialized.
+    void SetGenerator( ListGenerator* generator ) {
+        Detach();
+        type_ = TYPE_GENERATOR;
+        generator_ = generator;
+    }
+
+    // Take over the list , no copy is made
+    void SetList( std::vector<Mandu*>&& list );
+
+    // Make a record of the layout , there is one field for each field of the
+    // layout in the same order. The layout is owned by the caller and must
+    // outlive the Mandu. Inside of a body $.name is the field called name of
+    // the $ , eg `[Rows]{<td>$.id</td><td>$.name|html</td>}`. When the $ is
+    // not a record the .name is kept as text.
+    void SetRecord( const RecordLayout* layout , const std::vector<Mandu*>& fields );
+    void SetRecord( const RecordLayout* layout , std::vector<Mandu*>&& fields );
+
+    // Refer to the elements [begin,end) of a list without copying them , eg
+    // one page of a large result. The list is a list , a list view or a
+    // columnar list and must not change while the view is used. A view of a
+    // columnar list is a columnar list again. In a template the same is
+    // written as Rows[100:200].
+    void SetListView( const Mandu& list , std::size_t begin , std::size_t end );
+
+    // Reserve the capacity of the list. Append elements with AppendList then
+    // no reallocation happens. A Mandu which is not a list becomes an empty list.
+    void ReserveList( std::size_t capacity );
+
+    // Append an element at the end of the list in place. A Mandu which is not
+    // a list becomes an empty list first.
+    void AppendList( Mandu* element );
+
     int type() const {
         return type_;
     }
@@ -108,6 +279,10 @@ private:
         switch( type_ ) {
             case TYPE_NONE:
             case TYPE_NUMBER:
+            case TYPE_INT_ARRAY:
+            case TYPE_STRING_COLUMN:
+            case TYPE_GENERATOR:
+            case TYPE_LIST_VIEW:
                 return;
             case TYPE_STRING:
                 reinterpret_cast<std::string*>(string_buf_)->~string();
@@ -116,6 +291,10 @@ private:
                 reinterpret_cast<
                     std::vector<Mandu*>*>(mandu_list_buf_)->~vector<Mandu*>();
                 return;
+            case TYPE_RECORD:
+                reinterpret_cast<
+                    std::vector<Mandu*>*>(record_.fields_buf)->~vector<Mandu*>();
+                return;
             default:
                 assert(0);
                 return;
@@ -132,23 +311,64 @@ private:
         type_( TYPE_NONE )
     {}
 
-    Mandu( int number ) {
+    Mandu( int number ):
+        type_( TYPE_NONE )
+    {
         SetNumber(number);
     }
 
-    Mandu( const std::string& str ) {
+    Mandu( const std::string& str ):
+        type_( TYPE_NONE )
+    {
         SetString(str);
     }
 
-    Mandu( const std::vector<Mandu*>& list ) {
+    Mandu( const std::vector<Mandu*>& list ):
+        type_( TYPE_NONE )
+    {
         SetList(list);
     }
 
+    Mandu( std::string&& str ):
+        type_( TYPE_NONE )
+    {
+        SetString(std::move(str));
+    }
+
+    Mandu( std::vector<Mandu*>&& list ):
+        type_( TYPE_NONE )
+    {
+        SetList(std::move(list));
+    }
+
 private:
+    // Number with its decimal text , "-2147483648" is the longest one
+    struct Number {
+        int value;
+        unsigned char length;
+        char text[11];
+    };
+
+    // Record , the fields are a vector like the list
+    struct Record {
+        char fields_buf[sizeof( std::vector<Mandu*> )];
+        const RecordLayout* layout;
+    };
+
+    // Columnar list which refers to the caller's memory
+    struct Column {
+        const void* data;
+        const std::size_t* offsets;
+        std::size_t size;
+    };
+
     union {
         char mandu_list_buf_[sizeof( std::vector<Mandu*> )];
         char string_buf_[sizeof(std::string)];
-        int number_;
+        Number number_;
+        Column column_;
+        Record record_;
+        ListGenerator* generator_;
     };
 
     int type_;
@@ -159,16 +379,482 @@ private:
     friend class detail::ZoneAllocator<Mandu>;
 };
 
+// VariableProvider computes the value of a variable lazily. It is called only
+// when the variable is really referenced by a cook , so a variable that is
+// only used inside of a disabled section costs nothing.
+class VariableProvider {
+public:
+    virtual ~VariableProvider() {}
+
+    // Store the value of the variable key into output. Returning false fails
+    // the cook.
+    virtual bool Provide( const std::string& key , Mandu* output ) = 0;
+};
+
+// ListGenerator produces the elements of a streaming list one by one , so a
+// large result set could be iterated by a list body without materializing
+// all of its rows first. A generator can't be read again inside of its own
+// body , eg `[G]{`[G]{$}`}` , such a cook fails.
+class ListGenerator {
+public:
+    virtual ~ListGenerator() {}
+
+    // Called each time before the list is iterated
+    virtual void Rewind() {}
+
+    // Store the next element into element , return false when there is no
+    // more element. The same element is refilled for each call.
+    virtual bool Next( Mandu* element ) = 0;
+};
+
+// Template is a read only template text which is memory mapped from a file.
+// The executor evaluates straight from the mapping, no copy is made, and the
+// mapped pages are shared with other processes that map the same file. The
+// offsets are std::size_t , so template larger than 2GB is fine on 64 bits.
+class Template {
+public:
+    Template();
+    ~Template();
+
+    // Map the file at path read only. Any previous mapping is released. On
+    // failure false is returned and the error string holds the reason. A file
+    // written by Save is recognized and used right from the mapping.
+    bool Load( const std::string& path , std::string* error );
+
+    // Write the template in the compiled form , eg at build time after
+    // Minify. The file holds the text and an index of its top level pieces
+    // with offsets only , and it is checked when it is written , so a broken
+    // template is found before it is deployed. The file is replaced with a
+    // rename.
+    bool Save( const std::string& path , std::string* error ) const;
+
+    // Whether the template is loaded from the compiled form
+    bool IsCompiled() const {
+        return pieces_ != NULL;
+    }
+
+    // Release the mapping
+    void Unload();
+
+    // Collapse the insignificant whitespace of the literal text once , the
+    // template then holds a minified copy instead of the mapping. Code
+    // segments , escapes and the content of pre , textarea , script and style
+    // elements are kept. Error locations refer to the minified text.
+    void Minify();
+
+    const char* data() const {
+        return data_;
+    }
+
+    std::size_t size() const {
+        return size_;
+    }
+
+    bool IsLoaded() const {
+        return loaded_;
+    }
+
+private:
+    void operator = ( const Template& );
+    Template( const Template& );
+
+    const char* data_;
+    std::size_t size_;
+    bool loaded_;
+    bool LoadCompiled( std::string* error );
+
+    // Whether data_ points to text_ instead of a mapping
+    bool minified_;
+    std::string text_;
+
+    // The file mapping , data_ points into it unless the template is minified
+    const char* map_;
+    std::size_t map_size_;
+
+    // Index of a compiled template , NULL for a plain text template
+    const detail::TemplatePiece* pieces_;
+    std::size_t piece_count_;
+
+    friend class SoupMaker;
+    friend class RenderCursor;
+};
+
+// TemplateStore keeps the mapped templates alive by their path, so a template
+// file is only mapped once no matter how many times it is cooked.
+class TemplateStore {
+public:
+    TemplateStore():
+        minify_whitespace_(false)
+    {}
+    ~TemplateStore() {
+        Clear();
+    }
+
+    // Get the template mapped from path, the file is mapped at the first
+    // time it is required. NULL is returned if the file cannot be mapped.
+    const Template* Load( const std::string& path , std::string* error );
+
+    // Unmap the template of path, all the pointer returned from Load for
+    // this path become invalid.
+    bool Unload( const std::string& path );
+
+    void Clear();
+
+    // Minify the templates when they are loaded , see Template::Minify
+    void SetMinifyWhitespace( bool minify ) {
+        minify_whitespace_ = minify;
+    }
+
+private:
+    void operator = ( const TemplateStore& );
+    TemplateStore( const TemplateStore& );
+
+    struct Entry {
+        std::string path;
+        Template* tpl;
+        bool operator < ( const std::string& p ) const {
+            return path < p;
+        }
+    };
+    std::vector<Entry> templates_;
+    bool minify_whitespace_;
+};
+
+// ScatterOutput holds the cooked text in scatter-gather form. Literal runs of
+// the template point straight into the template text ( or its mapping ) and
+// only the substituted values are copied into a small scratch arena. So the
+// template text must be kept alive until the output is written out.
+class ScatterOutput {
+public:
+    struct Slice {
+        const char* data;
+        std::size_t size;
+    };
+
+    ScatterOutput();
+    ~ScatterOutput();
+
+    // Append bytes by copying them into the scratch arena
+    void Append( const char* str , std::size_t length );
+
+    // Append bytes that outlive this output , only the pointer is recorded
+    void AppendLiteral( const char* str , std::size_t length );
+
+    const std::vector<Slice>& slices() const {
+        return slices_;
+    }
+
+    // Total bytes of all the slices
+    std::size_t size() const {
+        return size_;
+    }
+
+    // Write all the slices to the file descriptor with writev. For non
+    // blocking descriptor , if it would block false is returned and calling
+    // WriteTo again resumes where it stopped. True means all bytes written.
+    bool WriteTo( int fd , std::string* error );
+
+    // Flatten all the slices into the string
+    void AppendTo( std::string* output ) const;
+
+    // Drop all the slices. The scratch arena is kept for the next cook
+    void Clear();
+
+private:
+    void operator = ( const ScatterOutput& );
+    ScatterOutput( const ScatterOutput& );
+
+    char* Reserve( std::size_t length );
+
+    void Push( const char* str , std::size_t length );
+
+    static const std::size_t kScratchBlockSize = 4096;
+
+    struct Block {
+        char* data;
+        std::size_t capacity;
+    };
+
+    std::vector<Slice> slices_;
+    std::size_t size_;
+
+    // Scratch arena , blocks are never moved so slices can point into it
+    std::vector<Block> blocks_;
+    std::size_t cur_block_;
+    std::size_t block_used_;
+
+    // Progress of WriteTo
+    std::size_t written_slice_;
+    std::size_t written_offset_;
+};
+
+#ifdef MANDU_USE_ZLIB
+// Compressed output requires zlib , define MANDU_USE_ZLIB and link with -lz.
+
+// DeflateCache keeps the literal runs of the templates compressed , so the
+// static text is compressed once and only the dynamic text is compressed on
+// each cook. A block is found by the address and the size of the literal and
+// is checked against its crc32 , so a stale address is just compressed again.
+// Once the blocks exceed max_bytes the least recently used ones are dropped.
+// It is not thread safe , a cache must not be shared by the GzipOutputs of
+// several threads , give each thread its own.
+class DeflateCache {
+public:
+    static const std::size_t kDefaultMinSize = 128;
+    static const std::size_t kDefaultMaxBytes = 16*1024*1024;
+
+    // Literal runs shorter than min_size are compressed along with the
+    // dynamic text , since splicing a block costs a flush of the stream.
+    // The level is the zlib compression level , -1 is the default level.
+    // max_bytes caps the compressed bytes kept by the cache.
+    explicit DeflateCache( int level = -1 , std::size_t min_size = kDefaultMinSize ,
+            std::size_t max_bytes = kDefaultMaxBytes );
+    ~DeflateCache();
+
+    std::size_t min_size() const {
+        return min_size_;
+    }
+
+    // Number of the cached blocks
+    std::size_t size() const;
+
+    // Compressed bytes of the cached blocks
+    std::size_t bytes() const {
+        return bytes_;
+    }
+
+    void Clear();
+
+private:
+    void operator = ( const DeflateCache& );
+    DeflateCache( const DeflateCache& );
+
+    struct Block {
+        const char* data;
+        std::size_t size;
+        unsigned long crc;
+        // Raw deflate blocks ending at a byte boundary , without final block
+        std::string deflated;
+    };
+
+    // Get the compressed block of the literal , crc is the crc32 of it. The
+    // block is valid until the next call.
+    const Block* Get( const char* data , std::size_t size , unsigned long crc );
+
+    detail::DeflateCacheIndex* index_;
+    z_stream_s* stream_;
+    std::size_t min_size_;
+    std::size_t max_bytes_;
+    std::size_t bytes_;
+
+    friend class GzipOutput;
+    friend struct detail::DeflateCacheIndex;
+};
+
+// GzipOutput compresses the cooked text into the gzip format while it is
+// produced. The literal runs of the template are spliced in as precompressed
+// blocks from the DeflateCache , the data is still a single gzip member.
+class GzipOutput {
+public:
+    // The cache is optional and must outlive the output. The level is the
+    // zlib compression level of the dynamic text.
+    explicit GzipOutput( DeflateCache* cache = NULL , int level = -1 );
+    ~GzipOutput();
+
+    // Append bytes , they are compressed by the stream
+    void Append( const char* str , std::size_t length );
+
+    // Append static bytes , they come from the cache if they are long enough
+    void AppendLiteral( const char* str , std::size_t length );
+
+    // Write the final block and the gzip trailer
+    void Finish();
+
+    // The compressed bytes produced so far
+    const std::string& data() const {
+        return data_;
+    }
+
+    // Move the compressed bytes produced so far into output , this allows to
+    // send the data before the cook is finished , eg with RenderCursor.
+    void Take( std::string* output );
+
+    // Uncompressed size
+    std::size_t size() const {
+        return size_;
+    }
+
+    // Start a new gzip member
+    void Clear();
+
+private:
+    void operator = ( const GzipOutput& );
+    GzipOutput( const GzipOutput& );
+
+    void Flush( int flush );
+
+    DeflateCache* cache_;
+    z_stream_s* stream_;
+    std::string data_;
+    unsigned long crc_;
+    std::size_t size_;
+    // Whether the stream has input that is not flushed yet
+    bool pending_;
+    bool finished_;
+};
+#endif // MANDU_USE_ZLIB
+
+// Scope is a frozen set of variables shared by many SoupMakers , eg the site
+// wide labels and configuration. Build it once , freeze it and attach it with
+// SoupMaker::SetBaseScope. A variable is looked up in the SoupMaker first and
+// then in the scope , so a request could shadow any of them. Once frozen the
+// scope is never written and could be used from many threads at the same
+// time , as long as its values are not generators. It only holds values ,
+// providers belong to the SoupMaker.
+class Scope {
+public:
+    Scope();
+    ~Scope();
+
+    // Same as the ones of SoupMaker , only valid before Freeze
+    Mandu* NewMandu( const std::string& section , const std::string& key );
+    Mandu* NewMandu( const std::string& key );
+    Mandu* NewMandu();
+
+    void Freeze();
+    bool IsFrozen() const;
+
+private:
+    void operator = ( const Scope& );
+    Scope( const Scope& );
+
+    detail::ScopeImpl* impl_;
+    friend class SoupMaker;
+    friend class ScopePublisher;
+};
+
+// ScopePublisher lets a background thread update shared variables , eg the
+// prices or the counters , while other threads are cooking. The writer builds
+// a whole new Scope , freezes it and publishes it. Each SoupMaker attached
+// with SetScopePublisher takes the current version when a cook starts and
+// keeps using it to the end of the cook , so a page never mixes two versions.
+// Taking a version never blocks and neither does a publish. A version in use
+// by a cook ( or RenderCursor ) is kept , old versions are deleted by the
+// publisher once no cook uses them.
+class ScopePublisher {
+public:
+    ScopePublisher();
+    // No cook could be using the publisher anymore
+    ~ScopePublisher();
+
+    // The scope must be frozen and newly allocated , the publisher owns it
+    void Publish( Scope* scope );
+
+    // Number of versions published so far
+    uint64_t version() const;
+
+private:
+    void operator = ( const ScopePublisher& );
+    ScopePublisher( const ScopePublisher& );
+
+    detail::ScopePublisherImpl* impl_;
+    friend class SoupMaker;
+};
+
+// FragmentCache keeps the output of the top level code segments , eg a
+// navigation bar or a category list , for the SoupMakers that attach it with
+// SetFragmentCache. A segment remembers the variables , sections and partials
+// it read when it was evaluated , and the next cook collects their current
+// values and copies the cached output if they are the same , the values are
+// compared and not only their hash. Segments reading
+// a provider or a generator are always evaluated. The cache is bounded by
+// max_bytes , which counts the outputs and the values they were stored with ,
+// the least recently used outputs are dropped first , and it
+// could be shared by the SoupMakers of many threads.
+class FragmentCache {
+public:
+    explicit FragmentCache( std::size_t max_bytes );
+    ~FragmentCache();
+
+    void Clear();
+
+    // Bytes held by the cached outputs and their keys
+    std::size_t size() const;
+
+    uint64_t hit_count() const;
+    uint64_t miss_count() const;
+
+private:
+    void operator = ( const FragmentCache& );
+    FragmentCache( const FragmentCache& );
+
+    detail::FragmentCacheImpl* impl_;
+    friend class SoupMaker;
+};
+
+// RecordLayout is the list of the field names shared by the records of a
+// table. A field name is resolved to its position once for each place of a
+// template that reads it , the rows are then read by position.
+class RecordLayout {
+public:
+    explicit RecordLayout( const std::vector<std::string>& fields );
+
+    std::size_t field_size() const {
+        return names_.size();
+    }
+
+    const std::string& field_name( std::size_t index ) const {
+        return names_[index];
+    }
+
+    // Position of the field , -1 if not existed
+    int FindField( const std::string& name ) const;
+    int FindField( const char* name , std::size_t length ) const;
+
+    // Hash of the field names
+    uint64_t hash() const {
+        return hash_;
+    }
+
+private:
+    std::vector<std::string> names_;
+    // Field names as ( symbol , position ) sorted by symbol
+    std::vector<std::pair<int,int> > symbols_;
+    uint64_t hash_;
+};
+
 class SoupMaker {
 public:
+    // Metrics of DumpProfile
+    enum {
+        // Time spent in the frame itself , in microseconds
+        PROFILE_TIME,
+        // Number of times the frame is entered
+        PROFILE_CALLS,
+        // Bytes written by the frame itself
+        PROFILE_BYTES,
+        // Temporary Mandu allocated by the frame itself
+        PROFILE_ALLOCATIONS
+    };
+
     SoupMaker();
     ~SoupMaker();
 
-    // Create a new Mandu that binds not type
+    // Create a new Mandu that binds not type. The keys , section names and
+    // partial names are kept by the process until it exits , so they must come
+    // from a fixed set , put per request data into the values instead.
     Mandu* NewMandu( const std::string& section , const std::string& key );
     Mandu* NewMandu( const std::string& key );
     Mandu* NewMandu();
 
+    // Bind a provider to the variable instead of a value. The provider is
+    // called each time the variable is referenced , or only at the first
+    // reference of each cook if memoize is set. The provider is owned by the
+    // caller and binding a Mandu to the same key removes it.
+    void BindProvider( const std::string& section , const std::string& key ,
+            VariableProvider* provider , bool memoize );
+    void BindProvider( const std::string& key , VariableProvider* provider , bool memoize );
+
     // The section related operations
     bool EnableSection( const std::string& section_name );
     bool DisableSection( const std::string& section_name );
@@ -176,19 +862,192 @@ public:
 
     // This function will clear any states of the SoupMaker object and all the
     // Mandu objects you New from this SoupMaker becomes invalid. You should
-    // re-new any objects you want to use in later phase
+    // re-new any objects you want to use in later phase. The base scope is
+    // kept , so only the variables of the request need to be bound again.
     void Clear();
 
+    // Each template remembers its output size and the peak of its temporary
+    // Mandu , the next cook reserves the output string and the Mandu pool from
+    // them up front. These are the upper limits , in bytes for the output
+    // and in objects for a pool page. The defaults are 16MB and 512.
+    void SetSizingLimits( std::size_t max_output_reserve , std::size_t max_pool_page );
+
+    // The pages of the Mandu pools are kept for reuse when a SoupMaker is
+    // cleared or destroyed. Give the ones kept by the calling thread and the
+    // shared ones back to malloc , eg after a burst of large pages.
+    static void ReleaseFreeMemory();
+
+    // Profile the cooks of this SoupMaker. Each code segment and body ( by
+    // its line and column ) , partial and provider is a frame of a call tree
+    // with its count , inclusive time , bytes and temporary allocations.
+    // Disabling drops the data. Without profiling only a pointer is tested.
+    void EnableProfiling( bool enable );
+
+    // Write the profile as folded stacks , eg for flamegraph.pl , one line
+    // per call path with the metric of the path itself. False is returned if
+    // profiling is not enabled.
+    bool DumpProfile( int metric , std::string* output ) const;
+    void ResetProfile();
+
+    // Attach a frozen scope that is consulted after the variables of this
+    // SoupMaker. It must outlive the SoupMaker , NULL detaches it. The
+    // sections of the scope could be disabled per SoupMaker until Clear.
+    void SetBaseScope( const Scope* scope );
+
+    // Use the versions of a publisher as the base scope instead , it replaces
+    // the scope of SetBaseScope ( and the other way around ). It must outlive
+    // the SoupMaker , NULL detaches it.
+    void SetScopePublisher( ScopePublisher* publisher );
+
+    // Serve the top level segments from a shared fragment cache , see
+    // FragmentCache. It must outlive the SoupMaker , NULL detaches it.
+    void SetFragmentCache( FragmentCache* cache );
+
+    // Evaluate the top level code segments of a document on up to threads
+    // threads once it has at least min_segments of them. Each segment is
+    // cooked into its own buffer and the buffers are written out in order ,
+    // so the output is the same as the sequential one. The providers are
+    // called one at a time , but in no particular order. Once a segment reads
+    // a generator the document is cooked again sequentially , so a provider
+    // that is not memoized may be called twice. The threads are kept parked
+    // between the cooks and the segments of a text that is not a Template are
+    // found once per text. 0 or 1 thread disables it. A RenderCursor always
+    // cooks sequentially , so its memory stays bounded.
+    void SetParallelSegments( std::size_t threads , std::size_t min_segments );
+
+    // Register a named partial , a template fragment that is included with
+    // `@name` and is shared by all the templates. The text is checked once
+    // here and follows the rules of a body , so $ is the $ of the caller and
+    // the segments inside of it use the section of the caller by default.
+    // A partial with the same name is replaced. The partials survive Clear.
+    bool RegisterPartial( const std::string& name , const std::string& text , std::string* error );
+    bool RemovePartial( const std::string& name );
+
     // Cook the mandu soup with existed settings. This will perform the real template text
     // substitution here. The output will be stored inside of the output and also if any
     // error is happened, the error string will store the description
     bool Cook( const std::string& txt , std::string* output , std::string* error );
 
+    // Cook a mapped template , the template text is read straight from the
+    // mapping.
+    bool Cook( const Template& tpl , std::string* output , std::string* error );
+
+    // Map the template file at path and cook it. Use TemplateStore to keep the
+    // mapping alive if the file is cooked many times.
+    bool CookFile( const std::string& path , std::string* output , std::string* error );
+
+    // Collapse the insignificant whitespace of the text cooked by this maker ,
+    // see Template::Minify. It covers the text and the files passed to Cook ,
+    // CookFile and RenderCursor. The text is minified again by each cook , for
+    // a text cooked many times use Template::Minify or a TemplateStore with
+    // SetMinifyWhitespace , which minify it once when it is loaded. A Template
+    // is cooked as it is.
+    void SetMinifyWhitespace( bool minify );
+
+    // Cook into a scatter-gather output. The literal text of txt/tpl is not
+    // copied , so it must outlive the output. With SetMinifyWhitespace the
+    // literal text of txt is copied , the minified copy belongs to the maker.
+    bool Cook( const std::string& txt , ScatterOutput* output , std::string* error );
+    bool Cook( const Template& tpl , ScatterOutput* output , std::string* error );
+
+#ifdef MANDU_USE_ZLIB
+    // Cook into a gzip member , the output is cleared and finished
+    bool Cook( const std::string& txt , GzipOutput* output , std::string* error );
+    bool Cook( const Template& tpl , GzipOutput* output , std::string* error );
+#endif // MANDU_USE_ZLIB
+
 private:
     void operator = ( const SoupMaker& );
     SoupMaker( SoupMaker& );
 
     detail::Executor* impl_;
+    friend class RenderCursor;
+    friend class detail::BatchRendererImpl;
+};
+
+// RenderCursor cooks a template piece by piece. Each Next call fills the
+// caller's buffer and suspends the evaluation once the buffer is full, even
+// in the middle of a nested list body , and the following Next call resumes
+// from there. So a slow consumer never forces the whole page to be rendered
+// and buffered up front. The evaluation runs on a private stack of fixed size,
+// the memory of an in-flight cursor is bounded by that stack. The pages of the
+// stack are only committed when they are used , and a template nested too deep
+// for the stack fails the cook with an error.
+// The SoupMaker must not be cooked or modified until the cursor is done or
+// destroyed. Destroying an unfinished cursor aborts the cook , the evaluation
+// stops at the next segment , body iteration or provider call and the rest
+// of the page is not evaluated.
+class RenderCursor {
+public:
+    // Enough for the deepest nesting of partials the executor allows
+    static const std::size_t kDefaultStackSize = 1024*1024;
+
+    // The text or template must outlive the cursor
+    RenderCursor( SoupMaker* maker , const std::string& txt ,
+            std::size_t stack_size = kDefaultStackSize );
+    RenderCursor( SoupMaker* maker , const Template& tpl ,
+            std::size_t stack_size = kDefaultStackSize );
+    ~RenderCursor();
+
+    // Fill at most capacity bytes into buffer , the number of bytes written is
+    // stored inside of length. Return false if the cook fails.
+    bool Next( char* buffer , std::size_t capacity , std::size_t* length , std::string* error );
+
+    // Whether all the output has been produced
+    bool IsDone() const;
+
+private:
+    void operator = ( const RenderCursor& );
+    RenderCursor( const RenderCursor& );
+
+    detail::CursorImpl* impl_;
+};
+
+// A document of a BatchRenderer. The job is owned by the caller and must live
+// until Done is called.
+class BatchJob {
+public:
+    virtual ~BatchJob() {}
+
+    // Bind the variables of the document into the SoupMaker of the worker ,
+    // which is reset before , it is like a new SoupMaker without variables ,
+    // partials , scopes , caches or settings. Anything else the job needs
+    // is set up here. Return false to fail the job.
+    virtual bool Bind( SoupMaker* maker , std::string* error ) = 0;
+
+    // Called on the worker thread once the document is cooked. The output is
+    // a buffer of the worker that is reused for the next job , swap it out
+    // to keep it.
+    virtual void Done( bool ok , std::string* output , const std::string& error ) = 0;
+};
+
+// BatchRenderer cooks many independent documents on a pool of threads. Each
+// worker owns a SoupMaker and an output buffer that are reused from job to
+// job , so the pools of the worker warm up once. The jobs are spread over the
+// queues of the workers and an idle worker steals from the others , so a few
+// huge documents don't leave the other threads idle.
+class BatchRenderer {
+public:
+    // 0 means one thread per core
+    explicit BatchRenderer( std::size_t threads = 0 );
+    // Waits for the submitted jobs
+    ~BatchRenderer();
+
+    // Queue a document , the template and the text must live until the job
+    // is done. It could be called from any thread , also from Done.
+    void Submit( const Template* tpl , BatchJob* job );
+    void Submit( const std::string* text , BatchJob* job );
+
+    // Block until every submitted job is done
+    void Wait();
+
+    std::size_t thread_size() const;
+
+private:
+    void operator = ( const BatchRenderer& );
+    BatchRenderer( const BatchRenderer& );
+
+    detail::BatchRendererImpl* impl_;
 };
 } // mandu
 #endif // MANDU_H_